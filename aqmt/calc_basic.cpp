@@ -24,6 +24,7 @@ struct Parameters {
     std::string folder;
     double link;
     int samples_to_skip;
+    double compression; // t-digest compression, 0 to keep all samples
 
     Parameters() {
         rtt_d = 0;
@@ -31,132 +32,276 @@ struct Parameters {
         folder = "";
         link = 0;
         samples_to_skip = 0;
+        compression = 0;
     }
 };
 
-class Statistics {
+// Streaming quantile estimate (merging t-digest, Dunning & Ertl)
+//
+// Samples are buffered and merged into at most about `compression`
+// centroids, which are kept small near the tails, so memory does not
+// depend on the number of samples. The rank error is roughly
+// q(1-q) * 4 / compression, i.e. about 1% around the median and much
+// better for p1 and p99 with the default compression of 100.
+class TDigest {
   public:
-    Statistics() {
-        calculated_variance = false;
-        calculated_coeffVar = false;
-        _variance = NAN;
-        _average = NAN;
-        _coeffVar = NAN;
-        _samples = NULL;
+    TDigest(double compression) {
+        _compression = compression;
+        _buffer_size = 5 * compression;
+        _total = 0;
     }
 
-    void samples(std::vector<double> *new_samples) {
-        _samples = new_samples;
-        std::sort(_samples->begin(), _samples->end());
+    void add(double val, double weight) {
+        _buffer.push_back(Centroid(val, weight));
+        if (_buffer.size() >= _buffer_size) {
+            merge();
+        }
     }
 
-    std::vector<double> *samples() {
-        return _samples;
-    }
+    // value at quantile q (0..1), min and max are tracked by the caller
+    double quantile(double q, double min, double max) {
+        merge();
 
-    double p(double p) {
-        if (_samples != NULL && _samples->size() > 0) {
-            return _samples->at(percentile(p, _samples->size()) - 1);
+        if (_centroids.empty()) {
+            return NAN;
+        }
+        if (_centroids.size() == 1) {
+            return _centroids[0].mean;
         }
 
-        return NAN;
+        double rank = q * _total;
+
+        // each centroid is centered at the middle of its weight
+        double left = 0;
+        for (size_t i = 0; i < _centroids.size(); ++i) {
+            const Centroid &c = _centroids[i];
+            double mid = left + c.weight / 2;
+
+            if (rank < mid) {
+                if (i == 0) {
+                    // between min and the first centroid
+                    return min + (c.mean - min) * (rank / mid);
+                }
+                const Centroid &prev = _centroids[i - 1];
+                double prev_mid = left - prev.weight / 2;
+                return prev.mean + (c.mean - prev.mean) * (rank - prev_mid) / (mid - prev_mid);
+            }
+
+            left += c.weight;
+        }
+
+        // between the last centroid and max
+        const Centroid &last = _centroids.back();
+        double last_mid = _total - last.weight / 2;
+        return last.mean + (max - last.mean) * (rank - last_mid) / (_total - last_mid);
     }
 
-    double front() {
-        if (_samples != NULL && _samples->size() > 0) {
-            return _samples->front();
+  private:
+    struct Centroid {
+        Centroid(double m, double w) : mean(m), weight(w) {}
+        double mean;
+        double weight;
+        bool operator<(const Centroid &other) const { return mean < other.mean; }
+    };
+
+    double _compression;
+    size_t _buffer_size;
+    double _total;
+    std::vector<Centroid> _centroids;
+    std::vector<Centroid> _buffer;
+
+    // k1 scale function, centroids may span at most 1 in k
+    double k(double q) {
+        return _compression / (2 * M_PI) * asin(2 * q - 1);
+    }
+
+    void merge() {
+        if (_buffer.empty()) {
+            return;
         }
 
-        return NAN;
-    }
+        _buffer.insert(_buffer.end(), _centroids.begin(), _centroids.end());
+        std::sort(_buffer.begin(), _buffer.end());
 
-    double back() {
-        if (_samples != NULL && _samples->size() > 0) {
-            return _samples->back();
+        _total = 0;
+        for (const Centroid &c: _buffer) {
+            _total += c.weight;
         }
 
-        return NAN;
+        _centroids.clear();
+        Centroid cur = _buffer[0];
+        double left = 0; // weight before cur
+        double k_left = k(0);
+        for (size_t i = 1; i < _buffer.size(); ++i) {
+            const Centroid &c = _buffer[i];
+            double q = (left + cur.weight + c.weight) / _total;
+            if (k(q > 1 ? 1 : q) - k_left <= 1) {
+                cur.mean += (c.mean - cur.mean) * c.weight / (cur.weight + c.weight);
+                cur.weight += c.weight;
+            } else {
+                left += cur.weight;
+                k_left = k(left / _total);
+                _centroids.push_back(cur);
+                cur = c;
+            }
+        }
+        _centroids.push_back(cur);
+        _buffer.clear();
     }
+};
 
-    double variance() {
-        if (_samples != NULL && !calculated_variance) {
-            calculate_variance();
+// Statistics of a series of samples, added one at a time
+//
+// The mean and variance are updated for each sample (Welford), so they
+// are exact without a second pass. Percentiles are found by selection
+// (nth_element) in the kept samples when asked for, which is O(n) per
+// percentile instead of sorting everything. With a compression given,
+// no samples are kept and percentiles are estimated by a t-digest, so
+// memory use is constant for long series.
+class Statistics {
+  public:
+    Statistics(double compression = 0) {
+        _n = 0;
+        _mean = 0;
+        _m2 = 0;
+        _min = NAN;
+        _max = NAN;
+        _selected = -1;
+        _digest = NULL;
+        if (compression > 0) {
+            _digest = new TDigest(compression);
         }
+    }
 
-        return _variance;
+    ~Statistics() {
+        delete _digest;
     }
 
-    double average() {
-        if (_samples != NULL && !calculated_variance) {
-            calculate_variance();
+    void add(double val) {
+        add(val, 1);
+    }
+
+    // adds the same value count times
+    void add(double val, uint64_t count) {
+        if (count == 0) {
+            return;
         }
 
-        return _average;
-    }
+        // weighted Welford update
+        uint64_t n = _n + count;
+        double delta = val - _mean;
+        _mean += delta * count / n;
+        _m2 += delta * (val - _mean) * count;
+        _n = n;
 
-    double coeffVar() {
-        if (_samples != NULL && !calculated_coeffVar) {
-            calculate_coeffVar();
+        if (!(val >= _min)) _min = val;
+        if (!(val <= _max)) _max = val;
+
+        if (_digest != NULL) {
+            _digest->add(val, count);
+            return;
         }
 
-        return _coeffVar;
+        _samples.insert(_samples.end(), count, val);
+        _selected = -1;
     }
 
-    double stddev() {
-        return sqrt(variance());
+    uint64_t size() {
+        return _n;
     }
 
-  private:
-    bool calculated_variance;
-    bool calculated_coeffVar;
-    double _variance;
-    double _average;
-    double _coeffVar;
-    std::vector<double> *_samples;
-
-    void calculate_coeffVar() {
-        if (variance() > 0 && average() > 0) {
-            _coeffVar = stddev() / average();
-        } else {
-            _coeffVar = 0;
+    double p(double p) {
+        if (_n == 0) {
+            return NAN;
         }
 
-        calculated_coeffVar = true;
+        if (_digest != NULL) {
+            return _digest->quantile(p / 100, _min, _max);
+        }
+
+        int64_t k = percentile(p, _n) - 1;
+
+        // everything after (before) the last selected position is at
+        // least (at most) as large, so only that part is searched
+        std::vector<double>::iterator first = _samples.begin();
+        std::vector<double>::iterator last = _samples.end();
+        if (_selected >= 0 && k > _selected) {
+            first += _selected + 1;
+        } else if (_selected >= 0 && k < _selected) {
+            last = _samples.begin() + _selected;
+        }
+        if (k != _selected) {
+            std::nth_element(first, _samples.begin() + k, last);
+        }
+
+        _selected = k;
+        return _samples[k];
     }
 
-    void calculate_variance() {
-        double tot = 0;
-        long double sumsq = 0;
-        uint32_t n_samples = _samples->size();
+    double front() {
+        return _min;
+    }
+
+    double back() {
+        return _max;
+    }
 
-        for (double val: *_samples) {
-            tot += val;
-            sumsq += (long double) val * val;
+    double variance() {
+        if (_n > 1) {
+            return _m2 / (_n - 1);
         }
 
-        _variance = NAN;
-        if (n_samples > 1) {
-            _variance = ((double(n_samples) * sumsq) - (tot * tot)) / (double(n_samples) * double(n_samples - 1));
+        return NAN;
+    }
+
+    double average() {
+        if (_n > 0) {
+            return _mean;
         }
 
-        _average = tot / n_samples;
-        calculated_variance = true;
+        return NAN;
     }
+
+    double coeffVar() {
+        if (variance() > 0 && average() > 0) {
+            return stddev() / average();
+        }
+
+        return 0;
+    }
+
+    double stddev() {
+        return sqrt(variance());
+    }
+
+  private:
+    uint64_t _n;
+    double _mean;
+    double _m2; // sum of squared differences from the mean
+    double _min;
+    double _max;
+    std::vector<double> _samples;
+    int64_t _selected; // position nth_element was last used for, -1 if none
+    TDigest *_digest;  // used instead of _samples when streaming
+
+    // owns the digest
+    Statistics(const Statistics &);
+    Statistics &operator=(const Statistics &);
 };
 
 struct Results {
-    Statistics *rate_ecn;
-    Statistics *rate_nonecn;
-    Statistics *win_ecn;
-    Statistics *win_nonecn;
-    Statistics *queue_ecn;
-    Statistics *queue_nonecn;
-    Statistics *drops_ecn;
-    Statistics *drops_nonecn;
-    Statistics *marks_ecn;
-    Statistics *util_ecn;
-    Statistics *util_nonecn;
-    Statistics *util_total;
+    Statistics rate_ecn;
+    Statistics rate_nonecn;
+    Statistics win_ecn;
+    Statistics win_nonecn;
+    Statistics queue_ecn;
+    Statistics queue_nonecn;
+    Statistics drops_ecn;
+    Statistics drops_nonecn;
+    Statistics marks_ecn;
+    Statistics util_ecn;
+    Statistics util_nonecn;
+    Statistics util_total;
 
     double rr_static;
     double wr_static;
@@ -164,20 +309,13 @@ struct Results {
     double ecn_avg;
     double nonecn_avg;
 
-    Results() {
-        rate_ecn = new Statistics();
-        rate_nonecn = new Statistics();
-        win_ecn = new Statistics();
-        win_nonecn = new Statistics();
-        queue_ecn = new Statistics();
-        queue_nonecn = new Statistics();
-        drops_ecn = new Statistics();
-        drops_nonecn = new Statistics();
-        marks_ecn = new Statistics();
-        util_ecn = new Statistics();
-        util_nonecn = new Statistics();
-        util_total = new Statistics();
-
+    Results(double compression) :
+        rate_ecn(compression), rate_nonecn(compression),
+        win_ecn(compression), win_nonecn(compression),
+        queue_ecn(compression), queue_nonecn(compression),
+        drops_ecn(compression), drops_nonecn(compression),
+        marks_ecn(compression),
+        util_ecn(compression), util_nonecn(compression), util_total(compression) {
         rr_static = NAN;
         wr_static = NAN;
 
@@ -187,7 +325,7 @@ struct Results {
 };
 
 struct Parameters *params = new Parameters();
-struct Results *res = new Results();
+struct Results *res;
 
 void openFileR(std::ifstream& file, std::string filename) {
     file.open(filename.c_str());
@@ -228,8 +366,6 @@ void readFileMarks(std::string filename_marks, Statistics *stats, std::string fi
     openFileR(infile_marks, filename_marks);
     openFileR(infile_tot, filename_tot);
 
-    std::vector<double> *samples = new std::vector<double>();
-
     // Columns in drops file we are reading:
     // <sample number> <sample time> <marks>
 
@@ -263,12 +399,11 @@ void readFileMarks(std::string filename_marks, Statistics *stats, std::string fi
             marks_perc = marks * 100 / tot_packets;
         }
 
-        samples->push_back(marks_perc);
+        stats->add(marks_perc);
     }
 
     infile_marks.close();
     infile_tot.close();
-    stats->samples(samples);
 }
 
 void readFileDrops(std::string filename_drops, Statistics *stats, std::string filename_tot) {
@@ -276,8 +411,6 @@ void readFileDrops(std::string filename_drops, Statistics *stats, std::string fi
     openFileR(infile_drops, filename_drops);
     openFileR(infile_tot, filename_tot);
 
-    std::vector<double> *samples = new std::vector<double>();
-
     // Columns in drops file we are reading:
     // <sample number> <sample time> <drops>
 
@@ -311,7 +444,7 @@ void readFileDrops(std::string filename_drops, Statistics *stats, std::string fi
             drops_perc = drops * 100 / (tot_packets + drops);
         }
 
-        samples->push_back(drops_perc);
+        stats->add(drops_perc);
 
         if (drops_perc > 100) {
             std::cout << "too large drops perc: " << drops_perc << std::endl;
@@ -320,16 +453,12 @@ void readFileDrops(std::string filename_drops, Statistics *stats, std::string fi
 
     infile_drops.close();
     infile_tot.close();
-    stats->samples(samples);
 }
 
 void readFileRate(std::string filename, Statistics *stats_rate, Statistics *stats_win, double avg_queue, double rtt) {
     std::ifstream infile;
     openFileR(infile, filename);
 
-    std::vector<double> *samples_rate = new std::vector<double>();
-    std::vector<double> *samples_win = new std::vector<double>();
-
     // Columns in file we are reading:
     // <sample number> <sample time> <rate b/s>
 
@@ -365,13 +494,11 @@ void readFileRate(std::string filename, Statistics *stats_rate, Statistics *stat
             win = rate * rtt_with_queue_in_s;
         }
 
-        samples_rate->push_back(rate);
-        samples_win->push_back(win);
+        stats_rate->add(rate);
+        stats_win->add(win);
     }
 
     infile.close();
-    stats_rate->samples(samples_rate);
-    stats_win->samples(samples_win);
 }
 
 void getSamplesUtilization() {
@@ -382,10 +509,6 @@ void getSamplesUtilization() {
     openFileR(infile_ecn, filename_ecn);
     openFileR(infile_nonecn, filename_nonecn);
 
-    std::vector<double> *samples_ecn = new std::vector<double>();
-    std::vector<double> *samples_nonecn = new std::vector<double>();
-    std::vector<double> *samples_total = new std::vector<double>();
-
     // Columns in file we are reading:
     // <sample number> <sample time> <rate b/s>
 
@@ -419,25 +542,19 @@ void getSamplesUtilization() {
         util_nonecn = rate_nonecn * 100 / params->link;
         util_total = (rate_ecn+rate_nonecn) * 100 / params->link;
 
-        samples_ecn->push_back(util_ecn);
-        samples_nonecn->push_back(util_nonecn);
-        samples_total->push_back(util_total);
+        res->util_ecn.add(util_ecn);
+        res->util_nonecn.add(util_nonecn);
+        res->util_total.add(util_total);
     }
 
     infile_ecn.close();
     infile_nonecn.close();
-
-    res->util_ecn->samples(samples_ecn);
-    res->util_nonecn->samples(samples_nonecn);
-    res->util_total->samples(samples_total);
 }
 
 void readFileQS(std::string filename, Statistics *stats) {
     std::ifstream infile;
     openFileR(infile, filename);
 
-    std::vector<double> *samples = new std::vector<double>();
-
     // Columns in file we are reading:
     // <queuing delay in us> <number of packes not dropped> <number of packets dropped>
 
@@ -457,75 +574,86 @@ void readFileQS(std::string filename, Statistics *stats) {
             break;
         }
 
-        for (int i = 0; i < nrpackets; ++i) {
-            samples->push_back(us);
-        }
+        stats->add(us, nrpackets);
     }
 
     infile.close();
-
-    stats->samples(samples);
 }
 
 void getSamplesRateMarksDrops() {
-    readFileRate(params->folder + "/ta/rate_ecn", res->rate_ecn, res->win_ecn, res->queue_ecn->average(), params->rtt_d);
-    readFileMarks(params->folder + "/ta/marks_ecn", res->marks_ecn, params->folder + "/ta/packets_ecn");
-    readFileDrops(params->folder + "/ta/drops_ecn", res->drops_ecn, params->folder + "/ta/packets_ecn");
-    readFileRate(params->folder + "/ta/rate_nonecn", res->rate_nonecn, res->win_nonecn, res->queue_nonecn->average(), params->rtt_r);
-    readFileDrops(params->folder + "/ta/drops_nonecn", res->drops_nonecn, params->folder + "/ta/packets_nonecn");
+    readFileRate(params->folder + "/ta/rate_ecn", &res->rate_ecn, &res->win_ecn, res->queue_ecn.average(), params->rtt_d);
+    readFileMarks(params->folder + "/ta/marks_ecn", &res->marks_ecn, params->folder + "/ta/packets_ecn");
+    readFileDrops(params->folder + "/ta/drops_ecn", &res->drops_ecn, params->folder + "/ta/packets_ecn");
+    readFileRate(params->folder + "/ta/rate_nonecn", &res->rate_nonecn, &res->win_nonecn, res->queue_nonecn.average(), params->rtt_r);
+    readFileDrops(params->folder + "/ta/drops_nonecn", &res->drops_nonecn, params->folder + "/ta/packets_nonecn");
 }
 
 void getSamplesQS() {
-    readFileQS(params->folder + "/aggregated/queue_packets_drops_ecn_pdf", res->queue_ecn);
-    readFileQS(params->folder + "/aggregated/queue_packets_drops_nonecn_pdf", res->queue_nonecn);
+    readFileQS(params->folder + "/aggregated/queue_packets_drops_ecn_pdf", &res->queue_ecn);
+    readFileQS(params->folder + "/aggregated/queue_packets_drops_nonecn_pdf", &res->queue_nonecn);
 }
 
 void usage(int argc, char* argv[]) {
-    printf("Usage: %s <test_folder> <link b/s> <rtt_d> <rtt_r> <samples_to_skip>\n", argv[0]);
+    printf("Usage: %s [-t <compression>] <test_folder> <link b/s> <rtt_d> <rtt_r> <samples_to_skip>\n", argv[0]);
+    printf("  -t <compression>  estimate percentiles with a t-digest instead of keeping\n");
+    printf("                    all samples, for constant memory on long runs (e.g. 100,\n");
+    printf("                    higher is more accurate)\n");
     exit(1);
 }
 
 void loadParameters(int argc, char **argv) {
-    if (argc < 6) {
+    int opt;
+    while ((opt = getopt(argc, argv, "+t:")) != -1) {
+        switch (opt) {
+        case 't':
+            params->compression = atof(optarg);
+            break;
+        default:
+            usage(argc, argv);
+        }
+    }
+
+    if (argc - optind < 5) {
         usage(argc, argv);
     }
 
-    params->folder = argv[1];
-    params->link = atof(argv[2]);
-    params->rtt_d = (double) atoi(argv[3]);
-    params->rtt_r = (double) atoi(argv[4]);
-    params->samples_to_skip = atoi(argv[5]);
+    params->folder = argv[optind];
+    params->link = atof(argv[optind + 1]);
+    params->rtt_d = (double) atoi(argv[optind + 2]);
+    params->rtt_r = (double) atoi(argv[optind + 3]);
+    params->samples_to_skip = atoi(argv[optind + 4]);
 }
 
 int main(int argc, char **argv) {
     loadParameters(argc, argv);
+    res = new Results(params->compression);
 
     getSamplesQS();
     getSamplesRateMarksDrops();
     getSamplesUtilization();
 
-    if (res->rate_nonecn->average() > 0) {
-        res->rr_static = res->rate_ecn->average() / res->rate_nonecn->average();
-        res->wr_static = res->win_ecn->average() / res->win_nonecn->average();
+    if (res->rate_nonecn.average() > 0) {
+        res->rr_static = res->rate_ecn.average() / res->rate_nonecn.average();
+        res->wr_static = res->win_ecn.average() / res->win_nonecn.average();
     }
 
-    if (res->drops_nonecn->p(99) > 100) {
-        std::cerr << "too high drops p99: " << res->drops_nonecn->p(99) << std::endl;
+    if (res->drops_nonecn.p(99) > 100) {
+        std::cerr << "too high drops p99: " << res->drops_nonecn.p(99) << std::endl;
         exit(1);
     }
 
-    writeStatistics("aggregated/queue_ecn_stats", res->queue_ecn);
-    writeStatistics("aggregated/queue_nonecn_stats", res->queue_nonecn);
-    //writeStatistics("aggregated/rate_ecn_stats", res->rate_ecn);
-    //writeStatistics("aggregated/rate_nonecn_stats", res->rate_nonecn);
-    writeStatistics("aggregated/window_ecn_stats", res->win_ecn);
-    writeStatistics("aggregated/window_nonecn_stats", res->win_nonecn);
-    writeStatistics("aggregated/drops_percent_ecn_stats", res->drops_ecn);
-    writeStatistics("aggregated/drops_percent_nonecn_stats", res->drops_nonecn);
-    writeStatistics("aggregated/marks_percent_ecn_stats", res->marks_ecn);
-    writeStatistics("aggregated/util_nonecn_stats", res->util_nonecn);
-    writeStatistics("aggregated/util_ecn_stats", res->util_ecn);
-    writeStatistics("aggregated/util_stats", res->util_total);
+    writeStatistics("aggregated/queue_ecn_stats", &res->queue_ecn);
+    writeStatistics("aggregated/queue_nonecn_stats", &res->queue_nonecn);
+    //writeStatistics("aggregated/rate_ecn_stats", &res->rate_ecn);
+    //writeStatistics("aggregated/rate_nonecn_stats", &res->rate_nonecn);
+    writeStatistics("aggregated/window_ecn_stats", &res->win_ecn);
+    writeStatistics("aggregated/window_nonecn_stats", &res->win_nonecn);
+    writeStatistics("aggregated/drops_percent_ecn_stats", &res->drops_ecn);
+    writeStatistics("aggregated/drops_percent_nonecn_stats", &res->drops_nonecn);
+    writeStatistics("aggregated/marks_percent_ecn_stats", &res->marks_ecn);
+    writeStatistics("aggregated/util_nonecn_stats", &res->util_nonecn);
+    writeStatistics("aggregated/util_ecn_stats", &res->util_ecn);
+    writeStatistics("aggregated/util_stats", &res->util_total);
 
     std::stringstream out;
 
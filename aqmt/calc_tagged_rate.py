@@ -5,6 +5,11 @@
 # as all the test traffic uses different ports we don't need to worry
 # about which nodes that sends traffic
 #
+# the rates are read from ta/rate_tagged when the analyzer has tagged the
+# traffic itself (-T), otherwise they are summed up from the per flow rates.
+# the analyzer reads the rules while the test runs, so the samples before
+# it had all of them are summed up from the per flow rates too
+#
 # the results are saved to:
 # - rate_tagged
 # - rate_tagged_stats
@@ -131,6 +136,47 @@ def get_rates(folder, flows, tags):
     return rates
 
 
+def get_rates_from_analyzer(folder):
+    """Read the rates the analyzer summed up for each tag"""
+
+    with open(folder + '/ta/tags') as f:
+        tags = [line.rstrip('\n') for line in f]
+
+    rates = {}
+    for tag in tags:
+        rates[tag] = []
+
+    with open(folder + '/ta/rate_tagged') as f:
+        # 0 1000 6152397 3693860
+        # tags added during the test have no column in the earlier samples
+        for line in f:
+            values = line.split()[2:]
+            for i, tag in enumerate(tags):
+                rates[tag].append(int(values[i]) if i < len(values) else 0)
+
+    # the first sample counted with all the rules
+    complete = 0
+    if os.path.exists(folder + '/ta/tags_complete'):
+        with open(folder + '/ta/tags_complete') as f:
+            complete = int(f.read())
+
+    if complete > 0 and os.path.exists(folder + '/ta/flows_rate_ecn'):
+        flow_tags, classify = get_classification(folder)
+        flows = get_flows(folder, classify)
+        flow_rates = get_rates(folder, flows, flow_tags)
+
+        for tag in rates:
+            values = flow_rates.get(tag, [])
+            for i in range(min(complete, len(rates[tag]), len(values))):
+                rates[tag][i] = values[i]
+
+    # remove unknown if all is tagged
+    if DEFAULT_TAG in rates and not any(rates[DEFAULT_TAG]):
+        rates.pop(DEFAULT_TAG)
+
+    return rates
+
+
 def extract_properties(line):
     """Convert the line in the 'details' file to a map"""
     list = {}
@@ -205,11 +251,15 @@ def process_test(folder, samples_to_skip):
     if not os.path.exists(folder + '/aggregated'):
         os.makedirs(folder + '/aggregated')
 
-    tags, classify = get_classification(folder)
     bitrate = get_bitrate(folder)
-    flows = get_flows(folder, classify)
 
-    rates = get_rates(folder, flows, tags)
+    # the analyzer sums up the tags itself when given the tag rules (-T)
+    if os.path.exists(folder + '/ta/rate_tagged'):
+        rates = get_rates_from_analyzer(folder)
+    else:
+        tags, classify = get_classification(folder)
+        flows = get_flows(folder, classify)
+        rates = get_rates(folder, flows, tags)
 
     save_tag_rates(folder, rates, samples_to_skip)
     save_tag_util(folder, rates, bitrate, samples_to_skip)
@@ -9,6 +9,10 @@
 # - derived/window
 #   each line formatted as: <sample id> <window ecn in bits> <window nonecn in bits>
 #
+# The RTT measured by the analyzer (ta/rtt_ecn and ta/rtt_nonecn) is used
+# when available, otherwise it is estimated as the base RTT plus the
+# average queue delay.
+#
 # Dependency:
 # - calc_queuedelay.py (for per sample queue stats)
 
@@ -55,6 +59,33 @@ def get_rtts_with_queue(queue_file, base_rtt):
     return rtts
 
 
+def get_rtts_measured(rtt_file, rtts_estimated):
+    rtts = []
+
+    with open(rtt_file, 'r') as f:
+        for i, line in enumerate(f):
+            # format of rtt file:
+            # <sample id> <sample time> <average in us> <min> <max> <number of rtt samples>
+            # the average is '-' if there were no rtt samples
+            rtt_avg = line.split()[2]
+            if rtt_avg == '-':
+                rtts.append(rtts_estimated[i])
+            else:
+                rtts.append(float(rtt_avg) / 1000 / 1000)
+
+    return rtts
+
+
+def get_rtts(folder, queue, base_rtt):
+    rtts = get_rtts_with_queue(folder + '/derived/queue_%s_samplestats' % queue, base_rtt)
+
+    rtt_file = folder + '/ta/rtt_%s' % queue
+    if os.path.exists(rtt_file):
+        rtts = get_rtts_measured(rtt_file, rtts)
+
+    return rtts
+
+
 def calc_window(rates, rtts_s):
     windows = []
 
@@ -82,11 +113,11 @@ def process_test(folder, base_rtt_ecn_ms, base_rtt_nonecn_ms):
         folder + '/derived/window',
         calc_window(
             get_rates(folder + '/ta/rate_ecn'),
-            get_rtts_with_queue(folder + '/derived/queue_ecn_samplestats', base_rtt_ecn_ms),
+            get_rtts(folder, 'ecn', base_rtt_ecn_ms),
         ),
         calc_window(
             get_rates(folder + '/ta/rate_nonecn'),
-            get_rtts_with_queue(folder + '/derived/queue_nonecn_samplestats', base_rtt_nonecn_ms),
+            get_rtts(folder, 'nonecn', base_rtt_nonecn_ms),
         ),
     )
 
@@ -0,0 +1,315 @@
+/* In-kernel aggregation for the traffic analyzer
+ *
+ * Does what processPacket does for every packet, but in the kernel: the
+ * metrics in the IP id (IPv4) or flow label (IPv6) are decoded and
+ * counted in per-CPU maps, so no packets are copied to user space. The
+ * analyzer reads the maps at each sample boundary (see bpf_maps.h and
+ * bpf_backend.cpp).
+ *
+ * Built with "make analyzer_bpf", and attached by the analyzer with -X
+ * to the monitored interface as tc program at the clsact egress hook,
+ * where the packets leave the AQM, or at ingress as tc or XDP program.
+ */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/pkt_cls.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+typedef __u32 u32;
+#include "numbers.h" /* metrics layout, see METRICS_FLAGS in the Makefile */
+#include "bpf_maps.h"
+
+#define VLAN_HLEN 4
+#define MAX_VLAN_TAGS 2
+#define MAX_IPV6_EXT_HDRS 4
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, TA_BPF_CONFIG_SIZE);
+	__type(key, __u32);
+	__type(value, __u32);
+} config SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, TA_BPF_CLASSES << QDELAY_BITS);
+	__type(key, __u32);
+	__type(value, struct ta_bpf_queue);
+} queue SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, 2);
+	__type(key, __u32);
+	__type(value, struct ta_bpf_totals);
+} totals SEC(".maps");
+
+struct flow_map {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__uint(max_entries, TA_BPF_FLOWS);
+	__type(key, struct ta_bpf_flow_key);
+	__type(value, struct ta_bpf_flow);
+} flows0 SEC(".maps"), flows1 SEC(".maps");
+
+/* the flow map of the current sample, swapped by the analyzer */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__array(values, struct flow_map);
+} flows SEC(".maps") = {
+	.values = { &flows0 },
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, TA_BPF_COUNTER_SIZE);
+	__type(key, __u32);
+	__type(value, __u64);
+} counters SEC(".maps");
+
+static __always_inline void count(__u32 counter)
+{
+	__u64 *c = bpf_map_lookup_elem(&counters, &counter);
+
+	if (c)
+		(*c)++;
+}
+
+static __always_inline __u32 config_get(__u32 index)
+{
+	__u32 *v = bpf_map_lookup_elem(&config, &index);
+
+	return v ? *v : 0;
+}
+
+static __always_inline int is_flow_proto(__u8 proto)
+{
+	return proto == IPPROTO_TCP || proto == IPPROTO_UDP ||
+	       proto == IPPROTO_ICMP || proto == IPPROTO_ICMPV6;
+}
+
+static __always_inline int has_ports(__u8 proto)
+{
+	return proto == IPPROTO_TCP || proto == IPPROTO_UDP;
+}
+
+/* the fields we need from the packet, as PacketInfo in packet.h */
+struct packet_info {
+	struct ta_bpf_flow_key key;
+	__u16 metrics;
+	__u8 tos;
+	__u32 addrbits;
+	__u32 len;
+};
+
+static __always_inline int parse_ports(void *l4, void *data_end, struct packet_info *pi)
+{
+	__u8 *p = l4;
+
+	if (!has_ports(pi->key.proto))
+		return 0;
+	if (l4 + 4 > data_end)
+		return -1;
+	pi->key.srcport = (p[0] << 8) | p[1];
+	pi->key.dstport = (p[2] << 8) | p[3];
+	return 0;
+}
+
+static __always_inline int parse_ipv4(void *l3, void *data_end, __u32 l2len, struct packet_info *pi)
+{
+	struct iphdr *iph = l3;
+	__u32 hlen;
+
+	if (l3 + sizeof(*iph) > data_end)
+		return -1;
+	hlen = iph->ihl * 4;
+	if (iph->version != 4 || hlen < sizeof(*iph) || bpf_ntohs(iph->tot_len) < hlen)
+		return -1;
+
+	pi->key.proto = iph->protocol;
+	pi->key.srcip[2] = bpf_htonl(0xffff);
+	pi->key.srcip[3] = iph->saddr;
+	pi->key.dstip[2] = bpf_htonl(0xffff);
+	pi->key.dstip[3] = iph->daddr;
+	pi->metrics = bpf_ntohs(iph->id);
+	pi->tos = iph->tos;
+	pi->addrbits = bpf_ntohl(iph->saddr);
+	pi->len = bpf_ntohs(iph->tot_len) + l2len;
+
+	return parse_ports(l3 + hlen, data_end, pi);
+}
+
+static __always_inline int parse_ipv6(void *l3, void *data_end, __u32 l2len, struct packet_info *pi)
+{
+	struct ipv6hdr *ip6h = l3;
+	void *l4 = l3 + sizeof(*ip6h);
+	__u32 flow;
+	__u8 nxt;
+	int i;
+
+	if (l4 > data_end || ip6h->version != 6)
+		return -1;
+
+	flow = bpf_ntohl(*(__be32 *) ip6h);
+	__builtin_memcpy(pi->key.srcip, &ip6h->saddr, 16);
+	__builtin_memcpy(pi->key.dstip, &ip6h->daddr, 16);
+	pi->metrics = flow & 0xffff;
+	pi->tos = (flow >> 20) & 0xff;
+	pi->addrbits = bpf_ntohl(pi->key.srcip[3]);
+	pi->len = bpf_ntohs(ip6h->payload_len) + sizeof(*ip6h) + l2len;
+
+	/* skip extension headers to find the transport header */
+	nxt = ip6h->nexthdr;
+#pragma unroll
+	for (i = 0; i < MAX_IPV6_EXT_HDRS; i++) {
+		__u8 *ext = l4;
+
+		if (nxt != IPPROTO_HOPOPTS && nxt != IPPROTO_ROUTING &&
+		    nxt != IPPROTO_DSTOPTS && nxt != IPPROTO_FRAGMENT)
+			break;
+		if (l4 + 8 > data_end)
+			return -1;
+		if (nxt == IPPROTO_FRAGMENT) {
+			nxt = ext[0];
+			l4 += 8;
+			if (((ext[2] << 8) | ext[3]) & 0xfff8) {
+				/* only the first fragment has the transport header */
+				pi->key.proto = nxt;
+				return 0;
+			}
+		} else {
+			nxt = ext[0];
+			l4 += (ext[1] + 1) * 8;
+		}
+	}
+
+	pi->key.proto = nxt;
+	return parse_ports(l4, data_end, pi);
+}
+
+static __always_inline void account(struct packet_info *pi)
+{
+	struct ta_bpf_queue *q;
+	struct ta_bpf_totals *tot;
+	struct ta_bpf_flow *fd;
+	struct ta_bpf_flow init = {};
+	__u32 drops, mark, cls, index;
+	__u64 bits;
+	void *fm;
+
+	drops = fl2int(METRICS_DROPS(pi->metrics), DROPS_M, DROPS_E);
+	mark = (pi->tos & 3) == 3;
+	bits = (__u64) pi->len * 8;
+
+	cls = pi->tos & 3;
+	if (config_get(TA_BPF_CONFIG_IPCLASS))
+		cls = pi->addrbits & 3;
+
+	index = (cls << QDELAY_BITS) | METRICS_QDELAY(pi->metrics);
+	q = bpf_map_lookup_elem(&queue, &index);
+	if (q) {
+		q->packets++;
+		q->drops += drops;
+	}
+
+	pi->key.ecn = cls != 0;
+	if (is_flow_proto(pi->key.proto)) {
+		index = pi->key.ecn;
+		tot = bpf_map_lookup_elem(&totals, &index);
+		if (tot) {
+			tot->rate += bits;
+			tot->drops += drops;
+			tot->marks += mark;
+		}
+	}
+
+	index = 0;
+	fm = bpf_map_lookup_elem(&flows, &index);
+	if (!fm)
+		return;
+	fd = bpf_map_lookup_elem(fm, &pi->key);
+	if (!fd) {
+		/* fails if another CPU added it since the lookup, or if
+		 * the map is full
+		 */
+		bpf_map_update_elem(fm, &pi->key, &init, BPF_NOEXIST);
+		fd = bpf_map_lookup_elem(fm, &pi->key);
+		if (!fd) {
+			count(TA_BPF_COUNTER_FLOWS_FULL);
+			return;
+		}
+	}
+	fd->rate += bits;
+	fd->packets++;
+	fd->drops += drops;
+	fd->marks += mark;
+}
+
+static __always_inline void process(void *data, void *data_end)
+{
+	struct packet_info pi = {};
+	struct ethhdr *eth = data;
+	__u32 l2len = sizeof(*eth);
+	__u16 ethertype;
+	int ret, i;
+
+	if (data + sizeof(*eth) > data_end) {
+		count(TA_BPF_COUNTER_MALFORMED);
+		return;
+	}
+	ethertype = bpf_ntohs(eth->h_proto);
+
+#pragma unroll
+	for (i = 0; i < MAX_VLAN_TAGS; i++) {
+		__u8 *tag = data + l2len;
+
+		if (ethertype != ETH_P_8021Q && ethertype != ETH_P_8021AD)
+			break;
+		if (data + l2len + VLAN_HLEN > data_end) {
+			count(TA_BPF_COUNTER_MALFORMED);
+			return;
+		}
+		ethertype = (tag[2] << 8) | tag[3];
+		l2len += VLAN_HLEN;
+	}
+
+	if (ethertype == ETH_P_IP) {
+		ret = parse_ipv4(data + l2len, data_end, l2len, &pi);
+	} else if (ethertype == ETH_P_IPV6) {
+		ret = parse_ipv6(data + l2len, data_end, l2len, &pi);
+	} else {
+		count(TA_BPF_COUNTER_NONIP);
+		return;
+	}
+
+	if (ret != 0) {
+		count(TA_BPF_COUNTER_MALFORMED);
+		return;
+	}
+
+	account(&pi);
+}
+
+SEC("xdp")
+int ta_xdp(struct xdp_md *ctx)
+{
+	process((void *)(long) ctx->data, (void *)(long) ctx->data_end);
+	return XDP_PASS;
+}
+
+SEC("tc")
+int ta_tc(struct __sk_buff *skb)
+{
+	/* make sure the headers are in the linear data */
+	bpf_skb_pull_data(skb, 128);
+	process((void *)(long) skb->data, (void *)(long) skb->data_end);
+	return TC_ACT_OK;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -1,4 +1,10 @@
 #include "analyzer.h"
+#include "packet.h"
+#include "sojourn.h"
+#include "trace.h"
+#ifdef TA_BPF
+#include "bpf_backend.h"
+#endif
 
 #include <csignal>
 #include <stdio.h>
@@ -6,10 +12,6 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <netinet/if_ether.h> // includes net/ethernet.h
-#include <netinet/ip.h>
-#include <netinet/udp.h>
-#include <netinet/tcp.h>
 #include <iostream>
 #include <map>
 #include <unistd.h>
@@ -22,28 +24,98 @@
 #include <array>
 #include <time.h>
 #include <sys/types.h>
-
-typedef u_int32_t u32; // we use "kernel-style" u32 variables in numbers.h
-#define TESTBED_ANALYZER 1
-#include "numbers.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <sstream>
 
 #define NSEC_PER_SEC 1000000000UL
 #define NSEC_PER_MS 1000000UL
 #define US_PER_S 1000000UL
 #define NSEC_PER_US 1000UL
 
+// Spread of the flow rates in a queue for one sample, added up in one
+// pass over the flows
 struct RateVar {
 public:
-    RateVar(uint32_t r, double c) {
-        rate = r;
-        cv = c;
+    RateVar() {
+        init();
+    }
+
+    uint32_t n;   // flows
+    double sum;   // b/s
+    double sumsq;
+
+    void init() {
+        n = 0;
+        sum = 0;
+        sumsq = 0;
+    }
+
+    void add(uint64_t rate) {
+        n++;
+        sum += rate;
+        sumsq += (double) rate * rate;
+    }
+
+    double rate() const {
+        return sum / n;
+    }
+
+    // coefficient of variation (population), 0 when all flows are equal
+    double cv() const {
+        double mean = rate();
+        double var = sumsq / n - mean * mean;
+        return var > 0 ? sqrt(var) / mean : 0;
+    }
+
+    // Jain's fairness index, 1 when all flows are equal and 1/n when one
+    // flow gets everything
+    double jain() const {
+        return sum * sum / (n * sumsq);
     }
-    uint32_t rate;
-    double cv;
 };
 
+// rates of the flows in the sample being processed
+static RateVar rv_ecn;
+static RateVar rv_nonecn;
+
 static void *printInfo(void *param);
 
+#ifdef TA_COUNT_ALLOCS
+// Count heap allocations, to check that the analyzer doesn't allocate
+// per packet or per sample once it has seen the flows. Not inlined, as
+// gcc then takes the malloc/free pairs for mismatched new/delete.
+static std::atomic<uint64_t> nr_allocations(0);
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    nr_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+uint64_t getAllocations()
+{
+    return nr_allocations.load(std::memory_order_relaxed);
+}
+#endif
+
 uint64_t getStamp()
 {
     // returns us
@@ -52,15 +124,277 @@ uint64_t getStamp()
     return ((uint64_t)monotime.tv_sec) * US_PER_S + monotime.tv_nsec / NSEC_PER_US;
 }
 
-ThreadParam::ThreadParam( uint32_t sinterval, std::string folder, bool ipc, uint32_t nrs)
+// Queuing delay is returned in us
+int decodeQdelay(u32 value) {
+    return qdelay_decode_table.v[value];
+}
+
+int decodeDrops(u32 value) {
+    return drops_decode_table.v[value];
+}
+
+Options::Options()
 {
-    // initialize qdelay conversion table
+    qdelay_precision = QDELAY_M;
+    qdelay_range = 0;
+    flow_hists = 0;
+    topk = 0;
+    snaplen = BUFSIZ;
+    verbose = false;
+    event_qdelay = 0;
+    event_drops = 0;
+    capture_cpu = -1;
+    report_cpu = -1;
+    realtime = false;
+    trace_mb = TRACE_FILE_MB;
+    trace_keep = 0;
+    spike_qdelay = 0;
+    spike_window = 1000;
+    sample_n = 1;
+    tcp_loss = false;
+    sojourn_timeout = SOJOURN_TIMEOUT;
+}
+
+bool DropCounters::read(uint64_t *d_ecn, uint64_t *d_nonecn)
+{
+    // read with a stack buffer, this is done every sample
+    char buf[512];
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        valid = false;
+        return false;
+    }
+    ssize_t len = ::read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 0) {
+        valid = false;
+        return false;
+    }
+    buf[len] = 0;
+
+    char name[64];
+    unsigned long long value;
+    uint64_t cur_ecn = 0;
+    uint64_t cur_nonecn = 0;
+    int found = 0;
+    int n;
+    for (char *p = buf; sscanf(p, "%63s %llu%n", name, &value, &n) == 2; p += n) {
+        if (strcmp(name, "drops_ecn") == 0) {
+            cur_ecn = value;
+            found++;
+        } else if (strcmp(name, "drops_nonecn") == 0) {
+            cur_nonecn = value;
+            found++;
+        }
+    }
+
+    if (found != 2) {
+        valid = false;
+        return false;
+    }
+
+    // the counters start over from zero when the qdisc is reset
+    bool ret = valid;
+    *d_ecn = cur_ecn >= ecn ? cur_ecn - ecn : cur_ecn;
+    *d_nonecn = cur_nonecn >= nonecn ? cur_nonecn - nonecn : cur_nonecn;
+    ecn = cur_ecn;
+    nonecn = cur_nonecn;
+    valid = true;
+    return ret;
+}
+
+void QdelayLayout::init(uint32_t p, uint32_t r)
+{
+    if (p > QDELAY_M)
+        p = QDELAY_M;
+
+    precision = p;
+    range = r;
+
+    // dropping the lowest mantissa bits merges neighbouring encoded
+    // values, both in the linear part and in each exponent
+    uint32_t shift = QDELAY_M - precision;
+    uint32_t last = (QS_LIMIT - 1) >> shift;
+
+    for (int i = 0; i < QS_LIMIT; ++i) {
+        uint32_t b = i >> shift;
+        if (range != 0 && b < last && (uint32_t) decodeQdelay(b << shift) >= range)
+            last = b;
+    }
+
     for (int i = 0; i < QS_LIMIT; ++i) {
-        qdelay_decode_table[i] = qdelay_decode(i);
+        uint32_t b = i >> shift;
+        bin[i] = b < last ? b : last;
     }
 
-    db1 = new DataBlock();
-    db2 = new DataBlock();
+    nbins = last + 1;
+    for (uint32_t b = 0; b < nbins; ++b) {
+        lower[b] = decodeQdelay(b << shift);
+    }
+}
+
+int FlowHist::percentile(double p, const QdelayLayout &layout) const
+{
+    uint64_t tot = 0;
+    for (int i = 0; i < FLOW_QS_BINS; ++i)
+        tot += bins[i];
+
+    if (tot == 0)
+        return -1;
+
+    uint64_t target = ceil(p / 100 * tot);
+    uint64_t sum = 0;
+    for (int i = 0; i < FLOW_QS_BINS; ++i) {
+        sum += bins[i];
+        if (sum >= target && sum > 0)
+            return layout.lower[i];
+    }
+
+    return layout.lower[FLOW_QS_BINS - 1];
+}
+
+bool TagRules::load(const std::string &file, const TagRules *prev)
+{
+    names.clear();
+    if (prev != NULL)
+        names = prev->names;
+    else
+        names.push_back(TAG_DEFAULT);
+    bzero(client, sizeof(client));
+    bzero(server, sizeof(server));
+    bzero(rule_tag, sizeof(rule_tag));
+    nrules = 0;
+
+    std::ifstream f(file.c_str());
+    if (!f.is_open())
+        return false;
+
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.compare(0, 8, "traffic=") != 0)
+            continue;
+
+        // key=value separated by spaces, the values may contain spaces
+        std::string tag, client_port, server_port, other;
+        std::string *value = NULL;
+        std::istringstream words(line);
+        std::string word;
+        while (words >> word) {
+            size_t eq = word.find('=');
+            if (eq != std::string::npos && eq > 0) {
+                std::string key = word.substr(0, eq);
+                value = key == "tag" ? &tag : key == "client" ? &client_port : key == "server" ? &server_port : &other;
+                *value = word.substr(eq + 1);
+            } else if (value != NULL) {
+                *value += " " + word;
+            }
+        }
+
+        if (tag.empty())
+            continue;
+
+        if (nrules == TAG_RULES_MAX) {
+            fprintf(stderr, "Too many tag rules in %s, ignoring the rest\n", file.c_str());
+            break;
+        }
+
+        uint32_t id = std::find(names.begin(), names.end(), tag) - names.begin();
+        if (id == names.size()) {
+            if (names.size() == TAG_MAX) {
+                fprintf(stderr, "Too many tags in %s, using %s for %s\n", file.c_str(), TAG_DEFAULT, tag.c_str());
+                id = 0;
+            } else {
+                names.push_back(tag);
+            }
+        }
+
+        nrules++;
+        rule_tag[nrules] = id;
+        uint8_t *table = client_port.empty() ? server : client;
+        uint16_t port = atoi(client_port.empty() ? server_port.c_str() : client_port.c_str());
+        if (table[port] == 0)
+            table[port] = nrules;
+    }
+
+    return true;
+}
+
+bool QueueClassifier::parse(const std::string &spec)
+{
+    size_t colon = spec.find(':');
+    std::string kind = spec.substr(0, colon);
+    if (colon == std::string::npos || (kind != "dscp" && kind != "port")) {
+        fprintf(stderr, "Classes must be given as dscp:.. or port:.., not %s\n", spec.c_str());
+        return false;
+    }
+    by_port = kind == "port";
+    uint8_t *table = by_port ? port : dscp;
+    uint32_t limit = by_port ? 65536 : 64;
+    bzero(port, sizeof(port));
+    bzero(dscp, sizeof(dscp));
+
+    std::istringstream classes(spec.substr(colon + 1));
+    std::string cls;
+    while (std::getline(classes, cls, ',')) {
+        if (names.size() == CLASSES_MAX - 1) {
+            fprintf(stderr, "At most %d classes\n", CLASSES_MAX - 1);
+            return false;
+        }
+        uint32_t id = names.size();
+        names.push_back(kind + cls);
+
+        std::istringstream values(cls);
+        std::string value;
+        while (std::getline(values, value, '+')) {
+            uint32_t first, last;
+            int n = sscanf(value.c_str(), "%u-%u", &first, &last);
+            if (n == 1)
+                last = first;
+            if (n < 1 || first > last || last >= limit) {
+                fprintf(stderr, "Invalid class %s in %s\n", cls.c_str(), spec.c_str());
+                return false;
+            }
+
+            // the first class given for a value wins
+            for (uint32_t v = first; v <= last; ++v) {
+                if (table[v] == 0)
+                    table[v] = id + 1;
+            }
+        }
+    }
+
+    other = names.size();
+    names.push_back(CLASS_DEFAULT);
+
+    // classify() looks up the DSCP directly
+    for (int i = 0; i < 64; ++i)
+        dscp[i] = dscp[i] == 0 ? other : dscp[i] - 1;
+    return true;
+}
+
+ThreadParam::ThreadParam( uint32_t sinterval, std::string folder, bool ipc, uint32_t nrs, const Options &opts)
+{
+    // initialize qdelay conversion table
+    layout.init(opts.qdelay_precision, opts.qdelay_range);
+    flow_layout.init(FLOW_QS_PRECISION, 0);
+    if (flow_layout.nbins > FLOW_QS_BINS) {
+        fprintf(stderr, "Per flow queue delay layout too large (%u bins)\n", flow_layout.nbins);
+        exit(1);
+    }
+
+    // the data blocks have counters for each class
+    classifier = NULL;
+    uint32_t nclasses = 0;
+    if (!opts.queue_classes.empty()) {
+        classifier = new QueueClassifier();
+        if (!classifier->parse(opts.queue_classes))
+            exit(1);
+        nclasses = classifier->names.size();
+        fd_pf_class.resize(nclasses);
+    }
+
+    db1 = new DataBlock(layout.nbins, opts, nclasses);
+    db2 = new DataBlock(layout.nbins, opts, nclasses);
     db1->init();
     db1->start = getStamp();
 
@@ -71,9 +405,83 @@ ThreadParam::ThreadParam( uint32_t sinterval, std::string folder, bool ipc, uint
     m_folder = folder;
     ipclass = ipc;
     m_nrs = nrs;
+    verbose = opts.verbose;
+    event_qdelay = opts.event_qdelay;
+    event_drops = opts.event_drops;
+    last_event = -1;
+    spike_qdelay = opts.spike_qdelay;
+    spike_window = opts.spike_window;
+    sample_n = opts.sample_n;
+    sample_threshold = UINT32_MAX / sample_n;
+    sample_rng = 0x9e3779b97f4a7c15ULL;
+    packets_sampled_out = 0;
+    capture_cpu = opts.capture_cpu;
+    report_cpu = opts.report_cpu;
+    realtime = opts.realtime;
+
+    for (uint32_t factor: opts.rollups) {
+        Rollup *r = new Rollup(factor, layout.nbins);
+        r->open(folder + "/rollup_" + std::to_string(factor * sinterval) + "ms", layout);
+        r->init();
+        r->id = 0;
+        rollups.push_back(r);
+    }
+
+    // the history grows with the samples, reserve it when we know how many
+    if (nrs != 0) {
+        sample_times.reserve(nrs);
+        fd_pf_ecn.row_start.reserve(nrs);
+        fd_pf_nonecn.row_start.reserve(nrs);
+        for (FlowHistory &h: fd_pf_class)
+            h.row_start.reserve(nrs);
+    }
+
+    m_descr = NULL;
+    m_descr_ack = NULL;
+    m_descr_ingress = NULL;
+    tcp_loss = opts.tcp_loss;
+    bpf = NULL;
+
+    sojourn = NULL;
+    if (!opts.ingress_dev.empty())
+        sojourn = new SojournMatcher(opts.sojourn_timeout, ipc);
+
+    trace = NULL;
+    if (!opts.trace_folder.empty()) {
+        mkdir(opts.trace_folder.c_str(), 0777);
+        trace = new TraceWriter(&m_mutex);
+        if (!trace->open(opts.trace_folder, opts.trace_mb, opts.trace_keep, ipc))
+            exit(1);
+    }
+
+    // the rules may not be there yet, see reloadTags
+    tags = NULL;
+    tags_file = opts.tag_rules;
+    tags_mtime.tv_sec = 0;
+    tags_mtime.tv_nsec = 0;
+    tags_complete = 0;
+    if (!tags_file.empty()) {
+        tags = new TagRules();
+        tags->load(tags_file, NULL);
+    }
+
+    drop_counters.file = opts.drop_counters;
+    drop_counters.ecn = 0;
+    drop_counters.nonecn = 0;
+    drop_counters.valid = false;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    clock_offset = (int64_t) (now.tv_sec * US_PER_S + now.tv_usec) - (int64_t) getStamp();
 
     packets_captured = 0;
     packets_processed = 0;
+    packets_nonip = 0;
+    packets_malformed = 0;
+    packets_ack = 0;
+    rtt_flows_expired = 0;
+    tcp_flows_expired = 0;
+    swaps = 0;
 
     quit = false;
     sample_id = 0;
@@ -95,6 +503,20 @@ void ThreadParam::swapDB(){ // called by printInfo
     db1 = db2;
     db2->start = getStamp();
     tmp->last = db1->start;
+    if (trace != NULL)
+        trace->sample(db1->start);
+
+    // the flows idle for FLOW_IDLE_SAMPLES, so the RTT and TCP loss
+    // state is bounded by the flows of the last samples and not of the
+    // whole run. A flow coming back starts its sequence anew, so the
+    // gap isn't counted as lost.
+    swaps++;
+    rtt_flows_expired += rtt_flows.removeIf([this](const RttState &rs) {
+        return swaps - rs.seen > FLOW_IDLE_SAMPLES;
+    });
+    tcp_flows_expired += tcp_flows.removeIf([this](const TcpSeqState &ss) {
+        return swaps - ss.seen > FLOW_IDLE_SAMPLES;
+    });
     pthread_mutex_unlock(&m_mutex);
     db2 = tmp;
 }
@@ -102,102 +524,321 @@ void ThreadParam::swapDB(){ // called by printInfo
 // we need ThreadParam global to use it in the signal handler
 static ThreadParam *tp;
 
+// Reads what the in-kernel aggregation counted into the capture block,
+// called right before it is swapped at the sample boundary
+static void collectKernel()
+{
+#ifdef TA_BPF
+    if (tp->bpf == NULL)
+        return;
+    pthread_mutex_lock(&tp->m_mutex);
+    tp->packets_captured += tp->bpf->collect(tp->db1, tp->layout);
+    pthread_mutex_unlock(&tp->m_mutex);
+#endif
+}
+
+// Reads the tag rules again if the file changed, as the traffic is
+// added to the details file while the test runs. The new rules are
+// swapped in for the capture thread at once, and first_sample is the
+// first sample counted only with them. The traffic of a rule before it
+// was read is tagged from the per flow history after the run, see
+// calc_tagged_rate.py.
+static void reloadTags(int first_sample)
+{
+    struct stat st;
+    if (tp->tags == NULL || stat(tp->tags_file.c_str(), &st) != 0)
+        return;
+    if (st.st_mtim.tv_sec == tp->tags_mtime.tv_sec && st.st_mtim.tv_nsec == tp->tags_mtime.tv_nsec)
+        return;
+
+    TagRules *rules = new TagRules();
+    rules->load(tp->tags_file, tp->tags);
+    tp->tags_mtime = st.st_mtim;
+
+    pthread_mutex_lock(&tp->m_mutex);
+    TagRules *old = tp->tags;
+    tp->tags = rules;
+    pthread_mutex_unlock(&tp->m_mutex);
+    if (rules->nrules != old->nrules)
+        tp->tags_complete = first_sample;
+    delete old;
+}
+
 void signalHandler(int signum) {
     tp->quit = true;
     pthread_cond_broadcast(&tp->quit_cond);
 }
 
-std::string IPtoString(in_addr_t ip) {
-    struct sockaddr_in ipip;
-    ipip.sin_addr.s_addr = ip;
-    return std::string(inet_ntoa(ipip.sin_addr));
-}
-
-// Queuing delay is returned in ns
-int decodeQdelay(u32 value) {
-    return qdelay_decode(value);
+// formats the address into buf, which must hold INET6_ADDRSTRLEN bytes
+const char *IPtoBuf(const IPAddr &ip, char *buf) {
+    if (ip.isV4())
+        return inet_ntop(AF_INET, &ip.w[3], buf, INET6_ADDRSTRLEN);
+    return inet_ntop(AF_INET6, ip.w, buf, INET6_ADDRSTRLEN);
 }
 
-int decodeDrops(u32 value) {
-    return fl2int(value, DROPS_M, DROPS_E);
+std::string IPtoString(const IPAddr &ip) {
+    char buf[INET6_ADDRSTRLEN];
+    return std::string(IPtoBuf(ip, buf));
 }
 
-void processPacket(u_char *, const struct pcap_pkthdr *header, const u_char *buffer)
+// Counts a parsed packet captured at now (us since the epoch). buffer is
+// only used for the TCP header, and can be NULL.
+template <typename C>
+static inline __attribute__((always_inline))
+void countPacket(const C *classifier, const PacketInfo &pi, uint64_t now, const u_char *buffer, uint32_t caplen)
 {
-    struct iphdr *iph = (struct iphdr*)(buffer + 14); // ethernet header is 14 bytes
-
-    uint8_t proto = iph->protocol;
-    uint16_t sport = 0;
-    uint16_t dport = 0;
+    const SrcDst &sd = pi.sd;
+    uint8_t proto = sd.m_proto;
 
-    uint16_t id = ntohs(iph->id);
-    int drops = decodeDrops(id >> 11); // drops stored in 5 bits MSB
+    uint16_t id = pi.metrics;
+    int drops = decodeDrops(testbed_encoding::drops_code(id)); // drops stored in the MSBs
 
     // We don't decode queueing delay here as we need to store it in a table,
     // so defer this to the actual serialization of the table to file
-    int qdelay_encoded = id & 2047; // qdelay stored in 11 bits LSB
+    int qdelay_encoded = testbed_encoding::qdelay_code(id); // qdelay stored in the LSBs
+    int qdelay_bin = tp->layout.bin[qdelay_encoded];
 
-    if (proto == IPPROTO_TCP) {
-        struct tcphdr *tcph = (struct tcphdr*)(buffer + 14 + iph->ihl*4);
-        sport = ntohs(tcph->source);
-        dport = ntohs(tcph->dest);
-    } else if (proto == IPPROTO_UDP) {
-        struct udphdr *udph = (struct udphdr*) (buffer + 14 + iph->ihl*4);
-        sport = ntohs(udph->source);
-        dport = ntohs(udph->dest);
-    }
-
-    SrcDst sd(proto, iph->saddr, sport, iph->daddr, dport);
-    uint64_t iplen = ntohs(iph->tot_len) + 14; // include the 14 bytes in ethernet header
-                                               // the link bandwidth includes it
+    uint64_t iplen = pi.len; // includes the ethernet header
+                             // the link bandwidth includes it
     iplen *= 8; // use bits
-    std::map<SrcDst,FlowData> *fmap;
+    FlowTable<SrcDst,FlowData> *fmap;
     uint32_t mark = 0;
 
-    uint8_t ts = iph->tos;
+    uint8_t ts = pi.tos;
     if ((ts & 3) == 3)
         mark = 1;
     if (tp->ipclass)
-        ts = ntohl(iph->saddr);
+        ts = pi.addrbits;
+
+    // With sampling the packets carrying drops or marks are all counted,
+    // so drops and marks stay exact, and one in sample_n of the rest is
+    // counted sample_n times. Skipped packets don't take the lock.
+    uint32_t weight = 1;
+    if (tp->sample_n > 1 && drops == 0 && mark == 0) {
+        tp->sample_rng ^= tp->sample_rng << 13;
+        tp->sample_rng ^= tp->sample_rng >> 7;
+        tp->sample_rng ^= tp->sample_rng << 17;
+        if ((uint32_t) (tp->sample_rng >> 32) >= tp->sample_threshold) {
+            tp->packets_sampled_out++; // only touched by the capture thread
+            return;
+        }
+        weight = tp->sample_n;
+        iplen *= weight;
+    }
+
+    uint64_t hash = sd.hash();
 
     pthread_mutex_lock(&tp->m_mutex);
 
+    if (tp->trace != NULL)
+        tp->trace->add(sd, hash, now, pi.len, id,
+                       (ts & TRACE_CLASS) | (mark ? TRACE_CE : 0));
+
     switch (ts & 3) {
     case 0:
-        tp->db1->tot_packets_nonecn++;
-        tp->db1->qs.ecn00[qdelay_encoded]++;
-        tp->db1->d_qs.ecn00[qdelay_encoded]+= drops;
+        tp->db1->tot_packets_nonecn += weight;
+        tp->db1->qs.ecn00[qdelay_bin] += weight;
+        tp->db1->d_qs.ecn00[qdelay_bin]+= drops;
         fmap = &tp->db1->fm.nonecn_rate;
         break;
     case 1:
-        tp->db1->tot_packets_ecn++;
-        tp->db1->qs.ecn01[qdelay_encoded]++;
-        tp->db1->d_qs.ecn01[qdelay_encoded]+= drops;
+        tp->db1->tot_packets_ecn += weight;
+        tp->db1->qs.ecn01[qdelay_bin] += weight;
+        tp->db1->d_qs.ecn01[qdelay_bin]+= drops;
         fmap = &tp->db1->fm.ecn_rate;
         break;
     case 2:
-        tp->db1->tot_packets_ecn++;
-        tp->db1->qs.ecn10[qdelay_encoded]++;
-        tp->db1->d_qs.ecn10[qdelay_encoded]+= drops;
+        tp->db1->tot_packets_ecn += weight;
+        tp->db1->qs.ecn10[qdelay_bin] += weight;
+        tp->db1->d_qs.ecn10[qdelay_bin]+= drops;
         fmap = &tp->db1->fm.ecn_rate;
         break;
     case 3:
-        tp->db1->tot_packets_ecn++;
-        tp->db1->qs.ecn11[qdelay_encoded]++;
-        tp->db1->d_qs.ecn11[qdelay_encoded]+= drops;
+        tp->db1->tot_packets_ecn += weight;
+        tp->db1->qs.ecn11[qdelay_bin] += weight;
+        tp->db1->d_qs.ecn11[qdelay_bin]+= drops;
         fmap = &tp->db1->fm.ecn_rate;
         break;
     }
 
-    std::pair<std::map<SrcDst,FlowData>::iterator,bool> ret;
-    ret = fmap->insert(std::pair<SrcDst,FlowData>(sd, FlowData((uint64_t)iplen, (uint32_t)drops, mark)));
-    if (ret.second == false)
-        fmap->at(sd).update(iplen, drops, mark);
+    (weight == 1 ? tp->db1->packets_exact : tp->db1->packets_sampled)++;
+
+    bool ecn = (ts & 3) != 0;
+    if (tp->spike_qdelay != 0) {
+        SpikeDetector &det = tp->spikes[ecn];
+        if (det.expire(now, tp->spike_window))
+            tp->db1->addEvent(det.ev);
+        det.add(now, decodeQdelay(qdelay_encoded), drops, weight, tp->spike_qdelay);
+        det.ev.ecn = ecn;
+    }
+
+    if (C::has_classes) {
+        ClassStats &cs = tp->db1->classes[classifier->classify(pi.tos, sd)];
+        cs.packets += weight;
+        cs.qs[qdelay_bin] += weight;
+        cs.d_qs[qdelay_bin] += drops;
+        if (isFlowProto(proto)) {
+            cs.tot.rate += iplen;
+            cs.tot.drops += drops;
+            cs.tot.marks += mark;
+
+            bool inserted;
+            FlowData &cfd = cs.fm.insert(sd, hash, FlowData(iplen, (uint32_t) drops, mark), &inserted);
+            if (!inserted)
+                cfd.update(iplen, drops, mark);
+        }
+    }
+
+    if (isFlowProto(proto)) {
+        ClassTotals &tot = ecn ? tp->db1->ecn_tot : tp->db1->nonecn_tot;
+        tot.rate += iplen;
+        tot.drops += drops;
+        tot.marks += mark;
+
+        if (tp->tags != NULL) {
+            ClassTotals &tag = tp->db1->tag_tot[tp->tags->lookup(sd)];
+            tag.rate += iplen;
+            tag.drops += drops;
+            tag.marks += mark;
+        }
+    }
+
+    FlowData *fd = NULL;
+    if (tp->db1->hh_ecn != NULL) {
+        HeavyHitters<SrcDst> *hh = ecn ? tp->db1->hh_ecn : tp->db1->hh_nonecn;
+        hh->update(sd, hash, iplen, drops, mark);
+    } else {
+        bool inserted;
+        fd = &fmap->insert(sd, hash, FlowData((uint64_t)iplen, (uint32_t)drops, mark), &inserted);
+        if (!inserted)
+            fd->update(iplen, drops, mark);
+
+        if (fd->hist == -1 && tp->db1->nr_flow_hists < tp->db1->max_flow_hists)
+            fd->hist = tp->db1->nr_flow_hists++;
+        if (fd->hist != -1)
+            tp->db1->flow_hists[fd->hist].bins[tp->flow_layout.bin[qdelay_encoded]] += weight;
+    }
+
+    uint32_t tsval, tsecr;
+    if (tp->m_descr_ack != NULL && buffer != NULL && parseTcpTimestamps(buffer, caplen, pi, &tsval, &tsecr)) {
+        bool inserted;
+        RttState &rs = tp->rtt_flows.insert(sd, hash, RttState(), &inserted);
+        rs.seen = tp->swaps;
+        rs.data.add(tsval, now);
+
+        // a new upstream half gives a new RTT sample
+        uint64_t sent;
+        if (rs.ack.match(tsecr, &sent)) {
+            rs.up = now - sent;
+            if (rs.down != -1) {
+                uint64_t rtt = rs.up + rs.down;
+                (ecn ? tp->db1->ecn_rtt : tp->db1->nonecn_rtt).add(rtt);
+                if (fd != NULL) {
+                    fd->rtt_sum += rtt;
+                    fd->rtt_n++;
+                }
+            }
+        }
+    }
+
+    uint32_t seq, seqlen;
+    bool syn;
+    if (tp->tcp_loss && buffer != NULL && parseTcpSeq(buffer, caplen, pi, &seq, &seqlen, &syn)) {
+        bool inserted;
+        TcpSeqState &ss = tp->tcp_flows.insert(sd, hash, TcpSeqState(), &inserted);
+        ss.seen = tp->swaps;
+        uint32_t lost = 0;
+        TcpSeqKind kind = ss.add(seq, seqlen, syn, now, &lost);
+
+        LossTotals &lt = ecn ? tp->db1->ecn_loss : tp->db1->nonecn_loss;
+        lt.lost += lost;
+        lt.retrans += kind == TCP_SEQ_RETRANS;
+        lt.reordered += kind == TCP_SEQ_REORDERED;
+        if (fd != NULL) {
+            fd->loss += lost;
+            fd->retrans += kind == TCP_SEQ_RETRANS;
+        }
+    }
 
     tp->packets_captured++;
     pthread_mutex_unlock(&tp->m_mutex);
 }
 
+template <typename C>
+void processPacket(u_char *user, const struct pcap_pkthdr *header, const u_char *buffer)
+{
+    PacketInfo pi;
+    switch (parsePacket(buffer, header->caplen, &pi)) {
+    case PARSE_OK:
+        break;
+    case PARSE_NOT_IP:
+        tp->packets_nonip++; // only touched by the capture thread
+        return;
+    case PARSE_MALFORMED:
+        tp->packets_malformed++;
+        return;
+    }
+
+    countPacket((const C *) user, pi, header->ts.tv_sec * US_PER_S + header->ts.tv_usec, buffer, header->caplen);
+}
+
+// With -I a packet is counted when both of its copies are seen, with
+// the sojourn time as its queue delay (see SojournMatcher). The egress
+// side is the main capture, which counts the frames it can't parse.
+template <typename C, bool egress>
+void processSojourn(u_char *user, const struct pcap_pkthdr *header, const u_char *buffer)
+{
+    PacketInfo pi;
+    switch (parsePacket(buffer, header->caplen, &pi)) {
+    case PARSE_OK:
+        break;
+    case PARSE_NOT_IP:
+        if (egress)
+            tp->packets_nonip++;
+        return;
+    case PARSE_MALFORMED:
+        if (egress)
+            tp->packets_malformed++;
+        return;
+    }
+
+    uint64_t now = header->ts.tv_sec * US_PER_S + header->ts.tv_usec;
+    SojournMatch m;
+    if (!tp->sojourn->add(pi, SojournMatcher::key(buffer, header->caplen, pi), now, egress, &m))
+        return;
+
+    // the TCP header is the same in both copies
+    countPacket((const C *) user, m.pi, m.time, buffer, header->caplen);
+}
+
+// ACKs of the captured flows, which only give the downstream half of
+// the RTT (see RttState)
+void processAck(u_char *, const struct pcap_pkthdr *header, const u_char *buffer)
+{
+    PacketInfo pi;
+    uint32_t tsval, tsecr;
+    if (parsePacket(buffer, header->caplen, &pi) != PARSE_OK ||
+        !parseTcpTimestamps(buffer, header->caplen, pi, &tsval, &tsecr))
+        return;
+
+    // the flows are known by their data direction
+    SrcDst sd(pi.sd.m_proto, pi.sd.m_dstip, pi.sd.m_dstport, pi.sd.m_srcip, pi.sd.m_srcport);
+    uint64_t now = header->ts.tv_sec * US_PER_S + header->ts.tv_usec;
+
+    pthread_mutex_lock(&tp->m_mutex);
+    RttState *rs = tp->rtt_flows.find(sd, sd.hash());
+    if (rs != NULL) {
+        rs->seen = tp->swaps;
+        rs->ack.add(tsval, now);
+
+        uint64_t sent;
+        if (rs->data.match(tsecr, &sent))
+            rs->down = now - sent;
+    }
+    tp->packets_ack++;
+    pthread_mutex_unlock(&tp->m_mutex);
+}
+
 void openFileW(std::ofstream& file, std::string filename) {
     file.open(filename.c_str());
     if (!file.is_open()) {
@@ -206,23 +847,242 @@ void openFileW(std::ofstream& file, std::string filename) {
     }
 }
 
-std::string getProtoRepr(uint8_t proto) {
+static const char *ecn_names[4] = {"ecn00", "ecn01", "ecn10", "ecn11"};
+
+void Rollup::open(const std::string &folder, const QdelayLayout &layout)
+{
+    mkdir(folder.c_str(), 0777);
+
+    for (int i = 0; i < 4; ++i) {
+        openFileW(f_queue_packets[i], folder + "/queue_packets_" + ecn_names[i]);
+        openFileW(f_queue_drops[i],   folder + "/queue_drops_" + ecn_names[i]);
+
+        // same header as the files for each sample
+        f_queue_packets[i] << layout.nbins;
+        f_queue_drops[i] << layout.nbins;
+        for (uint32_t b = 0; b < layout.nbins; ++b) {
+            f_queue_packets[i] << " " << layout.lower[b];
+            f_queue_drops[i] << " " << layout.lower[b];
+        }
+        f_queue_packets[i] << std::endl;
+        f_queue_drops[i] << std::endl;
+    }
+
+    openFileW(f_rate_ecn,       folder + "/rate_ecn");
+    openFileW(f_rate_nonecn,    folder + "/rate_nonecn");
+    openFileW(f_drops_ecn,      folder + "/drops_ecn");
+    openFileW(f_drops_nonecn,   folder + "/drops_nonecn");
+    openFileW(f_marks_ecn,      folder + "/marks_ecn");
+    openFileW(f_rate,           folder + "/rate");
+    openFileW(f_packets_ecn,    folder + "/packets_ecn");
+    openFileW(f_packets_nonecn, folder + "/packets_nonecn");
+}
+
+void Rollup::init()
+{
+    nsamples = 0;
+    len = 0;
+    qs.init();
+    d_qs.init();
+    ecn_tot.init();
+    nonecn_tot.init();
+    packets_ecn = 0;
+    packets_nonecn = 0;
+}
+
+void Rollup::add(const DataBlock *db, uint64_t drops_ecn, uint64_t drops_nonecn)
+{
+    nsamples++;
+    len += db->last - db->start;
+    qs.add(db->qs);
+    d_qs.add(db->d_qs);
+    ecn_tot.rate += db->ecn_tot.rate;
+    ecn_tot.drops += drops_ecn;
+    ecn_tot.marks += db->ecn_tot.marks;
+    nonecn_tot.rate += db->nonecn_tot.rate;
+    nonecn_tot.drops += drops_nonecn;
+    packets_ecn += db->tot_packets_ecn;
+    packets_nonecn += db->tot_packets_nonecn;
+}
+
+void Rollup::write(uint64_t time_ms)
+{
+    const QueueSize *q[2] = {&qs, &d_qs};
+    std::ofstream *f[2] = {f_queue_packets, f_queue_drops};
+    for (int k = 0; k < 2; ++k) {
+        const uint32_t *bins[4] = {q[k]->ecn00, q[k]->ecn01, q[k]->ecn10, q[k]->ecn11};
+        for (int i = 0; i < 4; ++i) {
+            f[k][i] << time_ms;
+            for (uint32_t b = 0; b < q[k]->nbins; ++b)
+                f[k][i] << " " << bins[i][b];
+            f[k][i] << std::endl;
+        }
+    }
+
+    uint64_t rate_ecn = len ? ecn_tot.rate * 1000000 / len : 0;
+    uint64_t rate_nonecn = len ? nonecn_tot.rate * 1000000 / len : 0;
+
+    f_rate_ecn << id << " " << time_ms << " " << rate_ecn << std::endl;
+    f_rate_nonecn << id << " " << time_ms << " " << rate_nonecn << std::endl;
+    f_drops_ecn << id << " " << time_ms << " " << ecn_tot.drops << std::endl;
+    f_drops_nonecn << id << " " << time_ms << " " << nonecn_tot.drops << std::endl;
+    f_marks_ecn << id << " " << time_ms << " " << ecn_tot.marks << std::endl;
+    f_rate << id << " " << time_ms << " " << (rate_ecn + rate_nonecn) << std::endl;
+    f_packets_ecn << packets_ecn << std::endl;
+    f_packets_nonecn << packets_nonecn << std::endl;
+
+    id++;
+    init();
+}
+
+void EventHold::add(std::ostream &f)
+{
+    files.push_back(&f);
+}
+
+void EventHold::begin()
+{
+    // the buffers are reused, so holding doesn't allocate once they
+    // have grown to a sample
+    if (held.empty()) {
+        held.resize(EVENT_HOLD_SAMPLES * files.size());
+        filebufs.resize(files.size());
+    }
+
+    for (uint32_t i = 0; i < files.size(); ++i) {
+        std::stringbuf &sb = held[next * files.size() + i];
+        sb.str("");
+        filebufs[i] = files[i]->rdbuf(&sb);
+    }
+}
+
+void EventHold::end()
+{
+    for (uint32_t i = 0; i < files.size(); ++i)
+        files[i]->rdbuf(filebufs[i]);
+
+    next = (next + 1) % EVENT_HOLD_SAMPLES;
+    if (count < EVENT_HOLD_SAMPLES)
+        count++;
+}
+
+void EventHold::flush()
+{
+    uint32_t slot = (next + EVENT_HOLD_SAMPLES - count) % EVENT_HOLD_SAMPLES;
+    for (; count > 0; --count) {
+        for (uint32_t i = 0; i < files.size(); ++i) {
+            std::string s = held[slot * files.size() + i].str();
+            files[i]->write(s.data(), s.size());
+        }
+        slot = (slot + 1) % EVENT_HOLD_SAMPLES;
+    }
+}
+
+void Rollup::close()
+{
+    for (int i = 0; i < 4; ++i) {
+        f_queue_packets[i].close();
+        f_queue_drops[i].close();
+    }
+    f_rate_ecn.close();
+    f_rate_nonecn.close();
+    f_drops_ecn.close();
+    f_drops_nonecn.close();
+    f_marks_ecn.close();
+    f_rate.close();
+    f_packets_ecn.close();
+    f_packets_nonecn.close();
+}
+
+void ClassFiles::open(const std::string &folder, const QdelayLayout &layout)
+{
+    mkdir(folder.c_str(), 0777);
+
+    openFileW(f_queue_packets, folder + "/queue_packets");
+    openFileW(f_queue_drops,   folder + "/queue_drops");
+    openFileW(f_rate,          folder + "/rate");
+    openFileW(f_drops,         folder + "/drops");
+    openFileW(f_marks,         folder + "/marks");
+    openFileW(f_packets,       folder + "/packets");
+
+    // same header as the files of the ECN queues
+    f_queue_packets << layout.nbins;
+    f_queue_drops << layout.nbins;
+    for (uint32_t b = 0; b < layout.nbins; ++b) {
+        f_queue_packets << " " << layout.lower[b];
+        f_queue_drops << " " << layout.lower[b];
+    }
+    f_queue_packets << std::endl;
+    f_queue_drops << std::endl;
+}
+
+void ClassFiles::write(const ClassStats &cs, int sample_id, uint64_t samplelen, uint64_t time_ms)
+{
+    f_queue_packets << time_ms;
+    f_queue_drops << time_ms;
+    for (uint32_t b = 0; b < tp->layout.nbins; ++b) {
+        f_queue_packets << " " << cs.qs[b];
+        f_queue_drops << " " << cs.d_qs[b];
+    }
+    f_queue_packets << std::endl;
+    f_queue_drops << std::endl;
+
+    f_rate << sample_id << " " << time_ms << " " << (cs.tot.rate * 1000000 / samplelen) << std::endl;
+    f_drops << sample_id << " " << time_ms << " " << cs.tot.drops << std::endl;
+    f_marks << sample_id << " " << time_ms << " " << cs.tot.marks << std::endl;
+    f_packets << cs.packets << std::endl;
+}
+
+void ClassFiles::close()
+{
+    f_queue_packets.close();
+    f_queue_drops.close();
+    f_rate.close();
+    f_drops.close();
+    f_marks.close();
+    f_packets.close();
+}
+
+const char *getProtoRepr(uint8_t proto) {
     if (proto == IPPROTO_TCP)
         return "TCP";
     else if (proto == IPPROTO_UDP)
         return "UDP";
     else if (proto == IPPROTO_ICMP)
         return "ICMP";
+    else if (proto == IPPROTO_ICMPV6)
+        return "ICMPv6";
     return "UNKNOWN";
 }
 
-void printStreamInfo(SrcDst sd)
+std::string flowLabel(const SrcDst &sd)
 {
-    std::cout << getProtoRepr(sd.m_proto) << " " << IPtoString(sd.m_srcip) << ":" << sd.m_srcport << " -> ";
-    std::cout << IPtoString(sd.m_dstip) << ":" << sd.m_dstport;
+    return std::string(getProtoRepr(sd.m_proto)) + " " + IPtoString(sd.m_srcip) + ":" + std::to_string(sd.m_srcport) +
+        " -> " + IPtoString(sd.m_dstip) + ":" + std::to_string(sd.m_dstport);
 }
 
-int setup_pcap(ThreadParam *param, char *dev, std::string &pcapfilter) 
+uint32_t FlowHistory::add(const SrcDst &srcdst, const FlowData &fd)
+{
+    // look up first, insert allocates a node even if the flow is there
+    auto it = columns.find(srcdst);
+    uint32_t column;
+    if (it != columns.end()) {
+        column = it->second;
+    } else {
+        column = columns.size();
+        columns.insert(std::pair<SrcDst,uint32_t>(srcdst, column));
+        labels.push_back(flowLabel(srcdst)); // formatted once per flow
+    }
+
+    size_t i = row_start.back() + column;
+    if (i >= data.size())
+        data.resize(i + 1);
+    data[i] = fd;
+    return column;
+}
+
+// opens dev for capturing with the filter, NULL if the filter is invalid
+pcap_t *open_pcap(const char *dev, const std::string &pcapfilter, int snaplen)
 {
     char errbuf[PCAP_ERRBUF_SIZE];
     pcap_t *descr;
@@ -236,141 +1096,332 @@ int setup_pcap(ThreadParam *param, char *dev, std::string &pcapfilter)
         mask = 0;
     }
 
-    param->m_descr = pcap_open_live(dev, BUFSIZ, 0, 1, errbuf);
+    descr = pcap_open_live(dev, snaplen, 0, 1, errbuf);
 
-    if (param->m_descr == NULL) {
+    if (descr == NULL) {
         printf("pcap_open_live(): %s\n", errbuf);
         exit(1);
     }
 
-    if (pcap_compile(param->m_descr, &fp, pcapfilter.c_str(), 0, net) == -1) {
-        fprintf(stderr, "Couldn't parse filter: %s\n", pcap_geterr(param->m_descr));
-        return(2);
+    if (pcap_compile(descr, &fp, pcapfilter.c_str(), 0, net) == -1) {
+        fprintf(stderr, "Couldn't parse filter: %s\n", pcap_geterr(descr));
+        return NULL;
     }
 
-    if (pcap_setfilter(param->m_descr, &fp) == -1) {
-        fprintf(stderr, "Couldn't install filter: %s\n", pcap_geterr(param->m_descr));
-        return(2);
+    if (pcap_setfilter(descr, &fp) == -1) {
+        fprintf(stderr, "Couldn't install filter: %s\n", pcap_geterr(descr));
+        return NULL;
     }
+
+    return descr;
 }
+
+int setup_pcap(ThreadParam *param, char *dev, std::string &pcapfilter, int snaplen)
+{
+    param->m_descr = open_pcap(dev, pcapfilter, snaplen);
+    return param->m_descr == NULL ? 2 : 0;
+}
+
 void setThreadParam(ThreadParam *param)
 {
     tp = param;
 }
 
+static void pinThread(pthread_t thread, int cpu, const char *name)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int ret = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (ret != 0)
+        fprintf(stderr, "Can't pin %s thread to cpu %d: %s\n", name, cpu, strerror(ret));
+}
+
 int start_analysis(ThreadParam *param)
 {
-    pthread_t thread_id[2];
+    pthread_t thread_id[4];
     pthread_attr_t attrs;
     pthread_attr_init(&attrs);
     pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_JOINABLE);
     int res;
     setThreadParam(param);
 
+    // with in-kernel aggregation there is nothing to capture
     thread_id[0] = 0;
-    res = pthread_create(&thread_id[0], &attrs, &pcapLoop, NULL);
+    if (tp->m_descr != NULL) {
+        res = pthread_create(&thread_id[0], &attrs, &pcapLoop, NULL);
 
-    if (res != 0) {
-        fprintf(stderr, "Error while creating thread, exiting...\n");
-        exit(1);
+        if (res != 0) {
+            fprintf(stderr, "Error while creating thread, exiting...\n");
+            exit(1);
+        }
+    }
+
+    thread_id[2] = 0;
+    if (tp->m_descr_ack != NULL) {
+        res = pthread_create(&thread_id[2], &attrs, &pcapLoopAck, NULL);
+
+        if (res != 0) {
+            fprintf(stderr, "Error while creating thread, exiting...\n");
+            exit(1);
+        }
+    }
+
+    thread_id[3] = 0;
+    if (tp->m_descr_ingress != NULL) {
+        res = pthread_create(&thread_id[3], &attrs, &pcapLoopIngress, NULL);
+
+        if (res != 0) {
+            fprintf(stderr, "Error while creating thread, exiting...\n");
+            exit(1);
+        }
     }
 
     thread_id[1] = 0;
-    pthread_create(&thread_id[1], &attrs, &printInfo, NULL);
+    res = pthread_create(&thread_id[1], &attrs, &printInfo, NULL);
 
     if (res != 0) {
         fprintf(stderr, "Error while creating thread, exiting...\n");
         exit(1);
     }
 
+    if (tp->capture_cpu >= 0 && thread_id[0] != 0)
+        pinThread(thread_id[0], tp->capture_cpu, "capture");
+    if (tp->report_cpu >= 0)
+        pinThread(thread_id[1], tp->report_cpu, "reporting");
+
+    if (tp->realtime) {
+        // the reporting thread mostly sleeps, so it can't starve others
+        struct sched_param sp;
+        sp.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+        res = pthread_setschedparam(thread_id[1], SCHED_FIFO, &sp);
+        if (res != 0)
+            fprintf(stderr, "Can't use SCHED_FIFO for the reporting thread: %s\n", strerror(res));
+    }
+
     std::signal(SIGINT, signalHandler);
     std::signal(SIGTERM, signalHandler);
 
     pthread_join(thread_id[1], NULL);
-    pcap_breakloop(tp->m_descr);
-    pthread_join(thread_id[0], NULL);
+    if (tp->m_descr != NULL) {
+        pcap_breakloop(tp->m_descr);
+        pthread_join(thread_id[0], NULL);
+    }
+    if (tp->m_descr_ack != NULL) {
+        pcap_breakloop(tp->m_descr_ack);
+        pthread_join(thread_id[2], NULL);
+    }
+    if (tp->m_descr_ingress != NULL) {
+        pcap_breakloop(tp->m_descr_ingress);
+        pthread_join(thread_id[3], NULL);
+    }
+
+#ifdef TA_BPF
+    if (tp->bpf != NULL) {
+        tp->packets_nonip = tp->bpf->counter(TA_BPF_COUNTER_NONIP);
+        tp->packets_malformed = tp->bpf->counter(TA_BPF_COUNTER_MALFORMED);
+        std::cout << "Packets of flows not counted (flow map full): " << tp->bpf->counter(TA_BPF_COUNTER_FLOWS_FULL) << std::endl;
+        tp->bpf->detach();
+    }
+#endif
 
-    std::cout << "Packets captured: " << tp->packets_captured << std::endl;
+    if (tp->trace != NULL) {
+        tp->trace->close();
+        std::cout << "Trace records lost: " << tp->trace->lost() << std::endl;
+    }
+
+    std::cout << "Packets captured: " << tp->packets_captured + tp->packets_sampled_out << std::endl;
     std::cout << "Packets processed: " << tp->packets_processed << std::endl;
+    std::cout << "Packets skipped (not IP): " << tp->packets_nonip << std::endl;
+    std::cout << "Packets skipped (malformed): " << tp->packets_malformed << std::endl;
+    if (tp->sample_n > 1)
+        std::cout << "Packets skipped (sampling): " << tp->packets_sampled_out << std::endl;
+    if (tp->sojourn != NULL) {
+        std::cout << "Packets matched at ingress and egress: " << tp->sojourn->matched << std::endl;
+        std::cout << "Drops inferred (not seen at egress): " << tp->sojourn->inferred << std::endl;
+        std::cout << "Packets not seen at ingress: " << tp->sojourn->unmatched_egress << std::endl;
+        std::cout << "Packets not matched (table full): " << tp->sojourn->overflow << std::endl;
+    }
+    if (tp->m_descr_ack != NULL) {
+        std::cout << "ACKs captured: " << tp->packets_ack << std::endl;
+        std::cout << "RTT flows expired (idle): " << tp->rtt_flows_expired << std::endl;
+    }
+    if (tp->tcp_loss)
+        std::cout << "TCP loss flows expired (idle): " << tp->tcp_flows_expired << std::endl;
+#ifdef TA_COUNT_ALLOCS
+    std::cout << "Heap allocations: " << getAllocations() << std::endl;
+#endif
 
     return 0;
 }
 
 void *pcapLoop(void *)
 {
-    // Put the device in sniff loop
-    pcap_loop(tp->m_descr, -1, processPacket, NULL);
+    // Put the device in sniff loop, with the classifier compiled in
+    pcap_handler handler;
+    if (tp->sojourn != NULL)
+        handler = tp->classifier != NULL ? processSojourn<QueueClassifier,true> : processSojourn<EcnClassifier,true>;
+    else
+        handler = tp->classifier != NULL ? processPacket<QueueClassifier> : processPacket<EcnClassifier>;
+    pcap_loop(tp->m_descr, -1, handler, (u_char *) tp->classifier);
     pcap_close(tp->m_descr);
     return 0;
 }
 
-void addFlow(std::map<SrcDst,std::vector<FlowData>> *fd_pf, SrcDst srcdst, FlowData fd) {
-    uint64_t samplelen = tp->db2->last - tp->db2->start;
-    uint64_t r = fd.rate * 1000000 / samplelen;
+void *pcapLoopIngress(void *)
+{
+    pcap_handler handler = tp->classifier != NULL ? processSojourn<QueueClassifier,false> : processSojourn<EcnClassifier,false>;
+    pcap_loop(tp->m_descr_ingress, -1, handler, (u_char *) tp->classifier);
+    pcap_close(tp->m_descr_ingress);
+    return 0;
+}
 
-    printStreamInfo(srcdst);
-    printf(" %lu bits/sec\n", r);
+void *pcapLoopAck(void *)
+{
+    pcap_loop(tp->m_descr_ack, -1, processAck, NULL);
+    pcap_close(tp->m_descr_ack);
+    return 0;
+}
 
-    if (srcdst.m_proto == IPPROTO_TCP || srcdst.m_proto == IPPROTO_UDP || srcdst.m_proto == IPPROTO_ICMP) {
-        if (fd_pf->count(srcdst) == 0) {
-            std::vector<FlowData> data;
-            data.resize(tp->sample_id);
-            fd_pf->insert(std::pair<SrcDst,std::vector<FlowData>>(srcdst, data));
-        }
+void addFlow(FlowHistory *fd_pf, RateVar *rv, SrcDst srcdst, FlowData fd) {
+    // added by initDB2 for its histogram, but not seen in the sample
+    if (fd.packets == 0)
+        return;
 
-        if (fd_pf->at(srcdst).size() != tp->sample_id) {
-            throw "Sample ID not equal to flow map size";
-        }
+    uint64_t samplelen = tp->db2->last - tp->db2->start;
+    uint64_t r = fd.rate * 1000000 / samplelen;
 
+    if (isFlowProto(srcdst.m_proto)) {
         fd.rate = r;
-        fd_pf->at(srcdst).push_back(fd);
+        if (fd.hist != -1) {
+            const FlowHist &fh = tp->db2->flow_hists[fd.hist];
+            fd.qdelay_p50 = fh.percentile(50, tp->flow_layout);
+            fd.qdelay_p90 = fh.percentile(90, tp->flow_layout);
+            fd.qdelay_p99 = fh.percentile(99, tp->flow_layout);
+            fd.hist = -1;
+        }
+        uint32_t column = fd_pf->add(srcdst, fd);
+        rv->add(r);
+        if (tp->verbose)
+            printf("%s %lu bits/sec\n", fd_pf->labels[column].c_str(), r);
+    } else if (tp->verbose) {
+        printf("%s %lu bits/sec\n", flowLabel(srcdst).c_str(), r);
     }
 }
 
 void processFD()
 {
-    printf("Throughput per stream (ECN queue):\n");
+    tp->fd_pf_ecn.newSample();
+    tp->fd_pf_nonecn.newSample();
 
-    for (auto& kv: tp->db2->fm.ecn_rate) {
-        const SrcDst& srcdst = kv.first;
-        FlowData& fd = kv.second;
+    if (tp->verbose)
+        printf("Throughput per stream (ECN queue):\n");
 
-        addFlow(&tp->fd_pf_ecn, srcdst, fd);
+    for (auto& e: tp->db2->fm.ecn_rate) {
+        addFlow(&tp->fd_pf_ecn, &rv_ecn, e.key, e.value);
     }
 
-    printf("Throughput per stream (non-ECN queue):\n");
-
-    for (auto& kv: tp->db2->fm.nonecn_rate) {
-        const SrcDst& srcdst = kv.first;
-        FlowData& fd = kv.second;
+    if (tp->verbose)
+        printf("Throughput per stream (non-ECN queue):\n");
 
-        addFlow(&tp->fd_pf_nonecn, srcdst, fd);
+    for (auto& e: tp->db2->fm.nonecn_rate) {
+        addFlow(&tp->fd_pf_nonecn, &rv_nonecn, e.key, e.value);
     }
+}
 
-    // make sure all lists are filled
-    for (auto& kv: tp->fd_pf_ecn) {
-        if (kv.second.size() != tp->sample_id + 1) {
-            kv.second.resize(tp->sample_id + 1);
+// the flows of each QueueClassifier class, which only has flows we
+// keep per flow statistics for
+void processClassFlows(uint64_t samplelen)
+{
+    for (uint32_t i = 0; i < tp->db2->nr_classes; ++i) {
+        FlowHistory &h = tp->fd_pf_class[i];
+        h.newSample();
+        for (auto& e: tp->db2->classes[i].fm) {
+            FlowData fd = e.value;
+            fd.rate = fd.rate * 1000000 / samplelen;
+            h.add(e.key, fd);
         }
     }
-    for (auto& kv: tp->fd_pf_nonecn) {
-        if (kv.second.size() != tp->sample_id + 1) {
-            kv.second.resize(tp->sample_id + 1);
+}
+
+// <sample id> <sample time> and value(fd) of each flow in h for each
+// sample, into the file
+template <typename F>
+void writeFlowsFile(const std::string &file, const FlowHistory &h, F value)
+{
+    std::ofstream f; openFileW(f, file);
+
+    for (size_t i = 0; i < tp->sample_times.size(); i++) {
+        f << i << " " << tp->sample_times[i];
+        for (auto const& kv: h.columns) {
+            f << " " << value(h.at(i, kv.second));
         }
+        f << std::endl;
     }
 }
 
-void wait(uint64_t sleep_ns) {
-    struct timespec target;
-    clock_gettime(CLOCK_MONOTONIC, &target);
+// flows_rate, flows_drops, flows_marks and flows of a class, as the
+// flows files of the ECN queues
+void writeClassFlows(const std::string &folder, const FlowHistory &h)
+{
+    writeFlowsFile(folder + "/flows_rate", h, [](const FlowData &fd) { return fd.rate; });
+    writeFlowsFile(folder + "/flows_drops", h, [](const FlowData &fd) { return fd.drops; });
+    writeFlowsFile(folder + "/flows_marks", h, [](const FlowData &fd) { return fd.marks; });
 
-    uint64_t nsec = target.tv_nsec + sleep_ns;
-    while (nsec > NSEC_PER_SEC) {
-        target.tv_sec++;
-        nsec -= NSEC_PER_SEC;
+    std::ofstream f_flows; openFileW(f_flows, folder + "/flows");
+    for (auto const& kv: h.columns) {
+        f_flows << getProtoRepr(kv.first.m_proto) << " " << IPtoString(kv.first.m_srcip) << " " << kv.first.m_srcport << " " << IPtoString(kv.first.m_dstip) << " " << kv.first.m_dstport << std::endl;
     }
+}
+
+struct FlowCandidate {
+    uint64_t rate;
+    bool ecn;
+    SrcDst srcdst;
+};
+
+// Initializes db2 for a new sample. When there were more flows than
+// queue delay histograms in the sample just processed, the histograms
+// are first given to the flows with most traffic, so the heavy flows keep
+// their histograms while the rest are handed out on first packet.
+void initDB2()
+{
+    DataBlock *db = tp->db2;
+    size_t nflows = db->fm.ecn_rate.size() + db->fm.nonecn_rate.size();
+
+    if (db->max_flow_hists == 0 || nflows <= db->max_flow_hists) {
+        db->init();
+        return;
+    }
+
+    static std::vector<FlowCandidate> top; // reused between samples
+    top.clear();
+    for (auto const& e: db->fm.ecn_rate)
+        top.push_back({e.value.rate, true, e.key});
+    for (auto const& e: db->fm.nonecn_rate)
+        top.push_back({e.value.rate, false, e.key});
+
+    std::nth_element(top.begin(), top.begin() + db->max_flow_hists, top.end(),
+        [](const FlowCandidate &a, const FlowCandidate &b) { return a.rate > b.rate; });
+    top.erase(top.begin() + db->max_flow_hists, top.end());
 
-    target.tv_nsec = nsec;
+    db->init();
+
+    for (auto const& c: top) {
+        FlowData fd;
+        bool inserted;
+        fd.hist = db->nr_flow_hists++;
+        (c.ecn ? db->fm.ecn_rate : db->fm.nonecn_rate).insert(c.srcdst, c.srcdst.hash(), fd, &inserted);
+    }
+}
+
+// Sleeps until the deadline (CLOCK_MONOTONIC in us, as from getStamp) or
+// until we are told to quit. The deadline is absolute, so the time spent
+// processing a sample doesn't delay the following samples.
+void waitUntil(uint64_t deadline_us) {
+    struct timespec target;
+    target.tv_sec = deadline_us / US_PER_S;
+    target.tv_nsec = (deadline_us % US_PER_S) * NSEC_PER_US;
 
     pthread_mutex_lock(&tp->quit_lock);
     int ret = 0;
@@ -381,6 +1432,165 @@ void wait(uint64_t sleep_ns) {
     pthread_mutex_unlock(&tp->quit_lock);
 }
 
+// Columns in the top-K files:
+// <sample id> <sample time> <error bound b/s> followed by
+// <proto> <src ip> <src port> <dst ip> <dst port> <rate b/s> <drops> <marks>
+// for each tracked flow, highest rate first
+void writeTopK(std::ofstream &f, HeavyHitters<SrcDst> *hh, RateVar *rv, uint64_t samplelen, uint64_t time_ms)
+{
+    static std::vector<HeavyHitters<SrcDst>::Entry> flows; // reused between samples
+    flows.clear();
+    for (uint32_t i = 0; i < hh->size(); ++i)
+        flows.push_back(hh->at(i));
+
+    std::sort(flows.begin(), flows.end(),
+        [](const HeavyHitters<SrcDst>::Entry &a, const HeavyHitters<SrcDst>::Entry &b) { return a.rate > b.rate; });
+
+    f << tp->sample_id << " " << time_ms << " " << (hh->errorBound() * 1000000 / samplelen);
+    for (auto const& e: flows) {
+        char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+        f << " " << getProtoRepr(e.key.m_proto) << " " << IPtoBuf(e.key.m_srcip, src) << " " << e.key.m_srcport;
+        f << " " << IPtoBuf(e.key.m_dstip, dst) << " " << e.key.m_dstport;
+        f << " " << (e.rate * 1000000 / samplelen) << " " << e.drops << " " << e.marks;
+        if (isFlowProto(e.key.m_proto))
+            rv->add(e.rate * 1000000 / samplelen);
+    }
+    f << std::endl;
+}
+
+// Ends the spikes that are over at the end of the sample, also when
+// there were no packets after them, so they go in this sample
+void expireSpikes()
+{
+    uint64_t now = tp->db2->last + tp->clock_offset;
+    pthread_mutex_lock(&tp->m_mutex);
+    for (int i = 0; i < 2; ++i) {
+        if (tp->spikes[i].expire(now, tp->spike_window))
+            tp->db2->addEvent(tp->spikes[i].ev);
+    }
+    pthread_mutex_unlock(&tp->m_mutex);
+}
+
+// one line for each queue delay spike that ended in the sample:
+// <sample id> <start us> <queue> <duration us> <peak qdelay us>
+// <qdelay EWMA before us> <packets> <drops>
+// where start is from the start of the test, and queue ecn or nonecn
+void writeEvents(std::ofstream &f)
+{
+    int64_t start = tp->start + tp->clock_offset;
+    for (uint32_t i = 0; i < tp->db2->nr_events; ++i) {
+        const SpikeEvent &ev = tp->db2->events[i];
+        f << tp->sample_id << " " << ((int64_t) ev.start - start) << " " << (ev.ecn ? "ecn" : "nonecn") << " "
+          << ev.duration << " " << ev.peak << " " << ev.ewma << " " << ev.packets << " " << ev.drops << std::endl;
+    }
+    if (tp->db2->events_lost > 0)
+        printf("Queue delay spikes not written (too many): %u\n", tp->db2->events_lost);
+}
+
+// <sample id> <sample time> <flows> <average flow rate b/s> <cv> <jain>
+// for the flows of a queue, "-" for the rate and spread without flows
+void writeFairness(std::ofstream &f, const RateVar &rv, uint64_t time_ms)
+{
+    f << tp->sample_id << " " << time_ms << " " << rv.n;
+    if (rv.n == 0)
+        f << " - - -" << std::endl;
+    else
+        f << " " << (uint64_t) rv.rate() << " " << rv.cv() << " " << rv.jain() << std::endl;
+}
+
+// <sample id> <sample time> <jain of all flows> <flow rate ratio> <window ratio>
+// where the ratios are the average ECN flow over the average non-ECN flow,
+// and the window is the flow rate times the measured RTT (-t) of its
+// queue. "-" when not known.
+void writeFairnessRatio(std::ofstream &f, const RateVar &ecn, const RateVar &nonecn, uint64_t time_ms)
+{
+    f << tp->sample_id << " " << time_ms;
+
+    RateVar all;
+    all.n = ecn.n + nonecn.n;
+    all.sum = ecn.sum + nonecn.sum;
+    all.sumsq = ecn.sumsq + nonecn.sumsq;
+    if (all.n == 0 || all.sum == 0)
+        f << " -";
+    else
+        f << " " << all.jain();
+
+    if (ecn.n == 0 || nonecn.n == 0 || nonecn.sum == 0) {
+        f << " - -" << std::endl;
+        return;
+    }
+
+    double ratio = ecn.rate() / nonecn.rate();
+    f << " " << ratio;
+
+    const RttTotals &rtt_ecn = tp->db2->ecn_rtt;
+    const RttTotals &rtt_nonecn = tp->db2->nonecn_rtt;
+    if (rtt_ecn.n == 0 || rtt_nonecn.n == 0)
+        f << " -" << std::endl;
+    else
+        f << " " << ratio * ((double) rtt_ecn.sum / rtt_ecn.n) / ((double) rtt_nonecn.sum / rtt_nonecn.n) << std::endl;
+}
+
+// <sample id> <sample time> followed by the value for each tag, in the
+// order of the tags file
+void writeTagged(std::ofstream &f, uint64_t ClassTotals::*field, uint64_t samplelen, uint64_t time_ms)
+{
+    f << tp->sample_id << " " << time_ms;
+    for (size_t i = 0; i < tp->tags->names.size(); ++i) {
+        uint64_t v = tp->db2->tag_tot[i].*field;
+        if (field == &ClassTotals::rate)
+            v = v * 1000000 / samplelen;
+        f << " " << v;
+    }
+    f << std::endl;
+}
+
+// <sample id> <sample time> <average> <min> <max> RTT in us followed by
+// the number of RTT samples, "-" for the RTTs if there were none
+void writeRtt(std::ofstream &f, const RttTotals &rtt, uint64_t time_ms)
+{
+    f << tp->sample_id << " " << time_ms;
+    if (rtt.n == 0)
+        f << " - - - 0" << std::endl;
+    else
+        f << " " << (rtt.sum / rtt.n) << " " << rtt.min << " " << rtt.max << " " << rtt.n << std::endl;
+}
+
+// per flow average RTT in us for each sample, -1 for samples without
+// RTT samples for the flow
+void writeFlowsRtt()
+{
+    auto value = [](const FlowData &fd) { return fd.rttAvg(); };
+    writeFlowsFile(tp->m_folder + "/flows_rtt_ecn", tp->fd_pf_ecn, value);
+    writeFlowsFile(tp->m_folder + "/flows_rtt_nonecn", tp->fd_pf_nonecn, value);
+}
+
+// <sample id> <sample time> <lost segments> <retransmitted> <reordered>
+void writeLoss(std::ofstream &f, const LossTotals &loss, uint64_t time_ms)
+{
+    f << tp->sample_id << " " << time_ms << " " << loss.lost << " " << loss.retrans << " " << loss.reordered << std::endl;
+}
+
+// per flow lost and retransmitted TCP segments for each sample
+void writeFlowsLoss()
+{
+    auto loss = [](const FlowData &fd) { return fd.loss; };
+    auto retrans = [](const FlowData &fd) { return fd.retrans; };
+    writeFlowsFile(tp->m_folder + "/flows_loss_ecn", tp->fd_pf_ecn, loss);
+    writeFlowsFile(tp->m_folder + "/flows_loss_nonecn", tp->fd_pf_nonecn, loss);
+    writeFlowsFile(tp->m_folder + "/flows_retrans_ecn", tp->fd_pf_ecn, retrans);
+    writeFlowsFile(tp->m_folder + "/flows_retrans_nonecn", tp->fd_pf_nonecn, retrans);
+}
+
+// per flow queue delay percentile in us for each sample, -1 for
+// samples where the flow had no histogram
+void writeFlowsQdelay(std::string name, int32_t FlowData::*field)
+{
+    auto value = [field](const FlowData &fd) { return fd.*field; };
+    writeFlowsFile(tp->m_folder + "/flows_qdelay_" + name + "_ecn", tp->fd_pf_ecn, value);
+    writeFlowsFile(tp->m_folder + "/flows_qdelay_" + name + "_nonecn", tp->fd_pf_nonecn, value);
+}
+
 void *printInfo(void *)
 {
     uint64_t time_ms;
@@ -407,27 +1617,106 @@ void *printInfo(void *)
     std::ofstream f_marks_ecn;             openFileW(f_marks_ecn,             tp->m_folder + "/marks_ecn");
     std::ofstream f_rate;                  openFileW(f_rate,                  tp->m_folder + "/rate");
 
+    // <sample id> <intended end of sample> <actual end> <actual - intended>
+    // in us since start, so the jitter of the sample boundaries is known
+    std::ofstream f_sample_boundaries;     openFileW(f_sample_boundaries,     tp->m_folder + "/sample_boundaries");
+
+    std::ofstream f_topk_ecn;
+    std::ofstream f_topk_nonecn;
+    if (tp->db1->hh_ecn != NULL) {
+        openFileW(f_topk_ecn,    tp->m_folder + "/topk_ecn");
+        openFileW(f_topk_nonecn, tp->m_folder + "/topk_nonecn");
+    }
+
+    // spread of the flow rates in each queue, and between the queues
+    std::ofstream f_fairness_ecn;          openFileW(f_fairness_ecn,          tp->m_folder + "/fairness_ecn");
+    std::ofstream f_fairness_nonecn;       openFileW(f_fairness_nonecn,       tp->m_folder + "/fairness_nonecn");
+    std::ofstream f_fairness_ratio;        openFileW(f_fairness_ratio,        tp->m_folder + "/fairness_ratio");
+
+    std::ofstream f_rate_tagged;
+    std::ofstream f_drops_tagged;
+    std::ofstream f_marks_tagged;
+    if (tp->tags != NULL) {
+        openFileW(f_rate_tagged,  tp->m_folder + "/rate_tagged");
+        openFileW(f_drops_tagged, tp->m_folder + "/drops_tagged");
+        openFileW(f_marks_tagged, tp->m_folder + "/marks_tagged");
+    }
+
+    // <sample id> <sample time> <packets counted once> <packets counted n times>
+    std::ofstream f_sampling;
+    if (tp->sample_n > 1)
+        openFileW(f_sampling, tp->m_folder + "/sampling");
+
+    ClassFiles *f_classes = NULL;
+    if (tp->classifier != NULL) {
+        f_classes = new ClassFiles[tp->classifier->names.size()];
+        for (uint32_t i = 0; i < tp->classifier->names.size(); ++i)
+            f_classes[i].open(tp->m_folder + "/class_" + tp->classifier->names[i], tp->layout);
+    }
+
+    std::ofstream f_events;
+    if (tp->spike_qdelay != 0)
+        openFileW(f_events, tp->m_folder + "/events");
+
+    std::ofstream f_rtt_ecn;
+    std::ofstream f_rtt_nonecn;
+    if (tp->m_descr_ack != NULL) {
+        openFileW(f_rtt_ecn,    tp->m_folder + "/rtt_ecn");
+        openFileW(f_rtt_nonecn, tp->m_folder + "/rtt_nonecn");
+    }
+
+    std::ofstream f_loss_ecn;
+    std::ofstream f_loss_nonecn;
+    if (tp->tcp_loss) {
+        openFileW(f_loss_ecn,    tp->m_folder + "/loss_ecn");
+        openFileW(f_loss_nonecn, tp->m_folder + "/loss_nonecn");
+    }
+
+    // the files gated by the event thresholds
+    EventHold f_hold;
+    if (tp->event_qdelay != 0 || tp->event_drops != 0) {
+        std::ostream *gated[] = {
+            &f_queue_packets_ecn00, &f_queue_packets_ecn01, &f_queue_packets_ecn10, &f_queue_packets_ecn11,
+            &f_queue_drops_ecn00, &f_queue_drops_ecn01, &f_queue_drops_ecn10, &f_queue_drops_ecn11,
+            &f_rate_ecn, &f_rate_nonecn, &f_drops_ecn, &f_drops_nonecn, &f_marks_ecn, &f_rate,
+            &f_packets_ecn, &f_packets_nonecn, &f_sampling,
+            &f_fairness_ecn, &f_fairness_nonecn, &f_fairness_ratio,
+            &f_rtt_ecn, &f_rtt_nonecn, &f_loss_ecn, &f_loss_nonecn,
+            &f_rate_tagged, &f_drops_tagged, &f_marks_tagged,
+        };
+        for (std::ostream *f: gated)
+            f_hold.add(*f);
+        for (uint32_t i = 0; f_classes != NULL && i < tp->classifier->names.size(); ++i) {
+            f_hold.add(f_classes[i].f_queue_packets);
+            f_hold.add(f_classes[i].f_queue_drops);
+            f_hold.add(f_classes[i].f_rate);
+            f_hold.add(f_classes[i].f_drops);
+            f_hold.add(f_classes[i].f_marks);
+            f_hold.add(f_classes[i].f_packets);
+        }
+    }
+
     // first column in header contains the number of columns following
-    f_queue_packets_ecn00 << QS_LIMIT;
-    f_queue_packets_ecn01 << QS_LIMIT;
-    f_queue_packets_ecn10 << QS_LIMIT;
-    f_queue_packets_ecn11 << QS_LIMIT;
-    f_queue_drops_ecn00 << QS_LIMIT;
-    f_queue_drops_ecn01 << QS_LIMIT;
-    f_queue_drops_ecn10 << QS_LIMIT;
-    f_queue_drops_ecn11 << QS_LIMIT;
-
-    // header row contains the queue delay this column represents
-    // e.g. a cell value multiplied by this header cell yields queue delay in us
-    for (int i = 0; i < QS_LIMIT; ++i) {
-        f_queue_packets_ecn00 << " " << tp->qdelay_decode_table[i];
-        f_queue_packets_ecn01 << " " << tp->qdelay_decode_table[i];
-        f_queue_packets_ecn10 << " " << tp->qdelay_decode_table[i];
-        f_queue_packets_ecn11 << " " << tp->qdelay_decode_table[i];
-        f_queue_drops_ecn00 << " " << tp->qdelay_decode_table[i];
-        f_queue_drops_ecn01 << " " << tp->qdelay_decode_table[i];
-        f_queue_drops_ecn10 << " " << tp->qdelay_decode_table[i];
-        f_queue_drops_ecn11 << " " << tp->qdelay_decode_table[i];
+    f_queue_packets_ecn00 << tp->layout.nbins;
+    f_queue_packets_ecn01 << tp->layout.nbins;
+    f_queue_packets_ecn10 << tp->layout.nbins;
+    f_queue_packets_ecn11 << tp->layout.nbins;
+    f_queue_drops_ecn00 << tp->layout.nbins;
+    f_queue_drops_ecn01 << tp->layout.nbins;
+    f_queue_drops_ecn10 << tp->layout.nbins;
+    f_queue_drops_ecn11 << tp->layout.nbins;
+
+    // header row contains the lower bound of the queue delay bin this
+    // column represents, in us (see QdelayLayout)
+    for (uint32_t i = 0; i < tp->layout.nbins; ++i) {
+        f_queue_packets_ecn00 << " " << tp->layout.lower[i];
+        f_queue_packets_ecn01 << " " << tp->layout.lower[i];
+        f_queue_packets_ecn10 << " " << tp->layout.lower[i];
+        f_queue_packets_ecn11 << " " << tp->layout.lower[i];
+        f_queue_drops_ecn00 << " " << tp->layout.lower[i];
+        f_queue_drops_ecn01 << " " << tp->layout.lower[i];
+        f_queue_drops_ecn10 << " " << tp->layout.lower[i];
+        f_queue_drops_ecn11 << " " << tp->layout.lower[i];
     }
     f_queue_packets_ecn00 << std::endl;
     f_queue_packets_ecn01 << std::endl;
@@ -441,32 +1730,104 @@ void *printInfo(void *)
     // first run
     // to get accurate results we swap the database and initialize timers here
     // (this way we don't time wrong and gets packets outside our time area)
+    reloadTags(0);
     tp->db2->init();
+    collectKernel();
     tp->swapDB();
     tp->start = tp->db1->start;
+    tp->db2->init(); // the packets before the start, not to be counted in the second sample
+
+    uint64_t counted_drops_ecn, counted_drops_nonecn;
+    if (!tp->drop_counters.file.empty()) {
+        tp->drop_counters.read(&counted_drops_ecn, &counted_drops_nonecn);
+        if (!tp->drop_counters.valid)
+            fprintf(stderr, "Can't read drop counters from %s, using drops in packets\n", tp->drop_counters.file.c_str());
+    }
 
-    wait(tp->m_sinterval * NSEC_PER_MS);
+    waitUntil(tp->start + tp->m_sinterval * 1000);
 
     uint64_t elapsed, next, sleeptime;
 
     while (1) {
+        collectKernel();
         tp->swapDB();
 
+        // read at the sample boundary, right after the swap
+        bool have_counted_drops = !tp->drop_counters.file.empty() &&
+            tp->drop_counters.read(&counted_drops_ecn, &counted_drops_nonecn);
+
         // time since we started processing
         time_ms = (tp->db2->last - tp->start) / 1000;
         tp->sample_times.push_back(time_ms);
 
+        uint64_t intended = ((uint64_t) tp->sample_id + 1) * tp->m_sinterval * 1000;
+        uint64_t actual = tp->db2->last - tp->start;
+        f_sample_boundaries << tp->sample_id << " " << intended << " " << actual << " " << (int64_t) (actual - intended) << std::endl;
+
         printf("\n--- BEGIN SAMPLE # %d", (int) tp->sample_id + 1);
         if (tp->m_nrs != 0) {
             printf(" of %d", tp->m_nrs);
         }
         printf(" -- total run time %d ms ---\n", (int) time_ms);
 
-        printf(" delay [ms]    ");
-        printf(" ECN 00: ");
-        printf(" ECN 01: ");
-        printf(" ECN 10: ");
-        printf(" ECN 11: \n");
+        uint64_t rate_ecn;
+        uint64_t rate_nonecn;
+        uint64_t drops_ecn;
+        uint64_t drops_nonecn;
+        uint64_t marks_ecn;
+
+        uint64_t samplelen = tp->db2->last - tp->db2->start;
+
+        // not gated by write_sample, there are few of them
+        if (tp->spike_qdelay != 0) {
+            expireSpikes();
+            writeEvents(f_events);
+        }
+
+        rv_ecn.init();
+        rv_nonecn.init();
+        if (tp->db2->hh_ecn != NULL) {
+            writeTopK(f_topk_ecn, tp->db2->hh_ecn, &rv_ecn, samplelen, time_ms);
+            writeTopK(f_topk_nonecn, tp->db2->hh_nonecn, &rv_nonecn, samplelen, time_ms);
+        } else {
+            processFD();
+        }
+        processClassFlows(samplelen);
+
+        // totals for each queue are counted while capturing, in all modes
+        rate_ecn = tp->db2->ecn_tot.rate * 1000000 / samplelen;
+        drops_ecn = tp->db2->ecn_tot.drops;
+        marks_ecn = tp->db2->ecn_tot.marks;
+        rate_nonecn = tp->db2->nonecn_tot.rate * 1000000 / samplelen;
+        drops_nonecn = tp->db2->nonecn_tot.drops;
+
+        if (have_counted_drops) {
+            drops_ecn = counted_drops_ecn;
+            drops_nonecn = counted_drops_nonecn;
+        }
+
+        for (Rollup *r: tp->rollups) {
+            r->add(tp->db2, drops_ecn, drops_nonecn);
+            if (r->nsamples == r->factor)
+                r->write(time_ms);
+        }
+
+        // with event thresholds the samples are only written around
+        // queue delay spikes and drop bursts, the rollups cover the rest.
+        // The samples before an event are held until it comes.
+        bool held = false;
+        if (tp->event_qdelay != 0 || tp->event_drops != 0) {
+            int max_bin = tp->db2->qs.maxBin();
+            if ((tp->event_qdelay != 0 && max_bin >= 0 && (uint32_t) tp->layout.lower[max_bin] >= tp->event_qdelay) ||
+                (tp->event_drops != 0 && drops_ecn + drops_nonecn >= tp->event_drops))
+                tp->last_event = tp->sample_id;
+            if (tp->last_event != -1 && tp->sample_id - tp->last_event <= EVENT_HOLD_SAMPLES) {
+                f_hold.flush();
+            } else {
+                f_hold.begin();
+                held = true;
+            }
+        }
 
         f_queue_packets_ecn00 << time_ms;
         f_queue_packets_ecn01 << time_ms;
@@ -477,11 +1838,17 @@ void *printInfo(void *)
         f_queue_drops_ecn10 << time_ms;
         f_queue_drops_ecn11 << time_ms;
 
-        for (int i = 0; i < QS_LIMIT; ++i) {
+        printf(" delay [ms]    ");
+        printf(" ECN 00: ");
+        printf(" ECN 01: ");
+        printf(" ECN 10: ");
+        printf(" ECN 11: \n");
+
+        for (uint32_t i = 0; i < tp->layout.nbins; ++i) {
             if (tp->db2->qs.ecn00[i] > 0 || tp->db2->qs.ecn01[i] > 0 || tp->db2->qs.ecn10[i] > 0 || tp->db2->qs.ecn11[i] > 0) {
                 // TODO: can we make it less verbose? e.g. group by some intervals?
                 printf("%9.3f:  %8d %8d %8d %8d\n",
-                    (double) tp->qdelay_decode_table[i] / 1000,
+                    (double) tp->layout.lower[i] / 1000,
                     tp->db2->qs.ecn00[i],
                     tp->db2->qs.ecn01[i],
                     tp->db2->qs.ecn10[i],
@@ -508,52 +1875,46 @@ void *printInfo(void *)
         f_queue_drops_ecn10 << std::endl;
         f_queue_drops_ecn11 << std::endl;
 
-        f_rate_ecn     << tp->sample_id << " " << time_ms;
-        f_rate_nonecn  << tp->sample_id << " " << time_ms;
-        f_drops_ecn    << tp->sample_id << " " << time_ms;
-        f_drops_nonecn << tp->sample_id << " " << time_ms;
-        f_marks_ecn    << tp->sample_id << " " << time_ms;
-        f_rate         << tp->sample_id << " " << time_ms;
+        f_rate_ecn     << tp->sample_id << " " << time_ms << " " << rate_ecn << std::endl;
+        f_rate_nonecn  << tp->sample_id << " " << time_ms << " " << rate_nonecn << std::endl;
+        f_drops_ecn    << tp->sample_id << " " << time_ms << " " << drops_ecn << std::endl;
+        f_drops_nonecn << tp->sample_id << " " << time_ms << " " << drops_nonecn << std::endl;
+        f_marks_ecn    << tp->sample_id << " " << time_ms << " " << marks_ecn << std::endl;
+        f_rate         << tp->sample_id << " " << time_ms << " " << (rate_ecn + rate_nonecn) << std::endl;
 
-        processFD();
+        f_packets_ecn << tp->db2->tot_packets_ecn << std::endl;
+        f_packets_nonecn << tp->db2->tot_packets_nonecn << std::endl;
 
-        uint64_t rate_ecn = 0;
-        uint64_t rate_nonecn = 0;
-        uint64_t drops_ecn = 0;
-        uint64_t drops_nonecn = 0;
-        uint64_t marks_ecn = 0;
+        for (uint32_t i = 0; i < tp->db2->nr_classes; ++i)
+            f_classes[i].write(tp->db2->classes[i], tp->sample_id, samplelen, time_ms);
 
-        for (auto const& val: tp->fd_pf_ecn) {
-            rate_ecn += val.second.at(tp->sample_id).rate;
-            drops_ecn += val.second.at(tp->sample_id).drops;
-            marks_ecn += val.second.at(tp->sample_id).marks;
-        }
+        if (tp->sample_n > 1)
+            f_sampling << tp->sample_id << " " << time_ms << " " << tp->db2->packets_exact << " " << tp->db2->packets_sampled << std::endl;
 
-        f_rate_ecn << " " << rate_ecn;
-        f_drops_ecn << " " << drops_ecn;
-        f_marks_ecn << " " << marks_ecn;
+        writeFairness(f_fairness_ecn, rv_ecn, time_ms);
+        writeFairness(f_fairness_nonecn, rv_nonecn, time_ms);
+        writeFairnessRatio(f_fairness_ratio, rv_ecn, rv_nonecn, time_ms);
 
-        for (auto const& val: tp->fd_pf_nonecn) {
-            rate_nonecn += val.second.at(tp->sample_id).rate;
-            drops_nonecn += val.second.at(tp->sample_id).drops;
+        if (tp->m_descr_ack != NULL) {
+            writeRtt(f_rtt_ecn, tp->db2->ecn_rtt, time_ms);
+            writeRtt(f_rtt_nonecn, tp->db2->nonecn_rtt, time_ms);
         }
 
-        f_rate_nonecn << " " << rate_nonecn;
-        f_drops_nonecn << " " << drops_nonecn;
+        if (tp->tcp_loss) {
+            writeLoss(f_loss_ecn, tp->db2->ecn_loss, time_ms);
+            writeLoss(f_loss_nonecn, tp->db2->nonecn_loss, time_ms);
+        }
 
-        f_rate << " " << (rate_ecn + rate_nonecn);
+        if (tp->tags != NULL) {
+            writeTagged(f_rate_tagged, &ClassTotals::rate, samplelen, time_ms);
+            writeTagged(f_drops_tagged, &ClassTotals::drops, samplelen, time_ms);
+            writeTagged(f_marks_tagged, &ClassTotals::marks, samplelen, time_ms);
+        }
 
-        f_rate << std::endl;
-        f_rate_ecn << std::endl;
-        f_rate_nonecn << std::endl;
-        f_drops_ecn << std::endl;
-        f_drops_nonecn << std::endl;
-        f_marks_ecn << std::endl;
+        if (held)
+            f_hold.end();
 
-        f_packets_ecn << tp->db2->tot_packets_ecn << std::endl;
-        f_packets_nonecn << tp->db2->tot_packets_nonecn << std::endl;
-
-        tp->packets_processed += tp->db2->tot_packets_nonecn + tp->db2->tot_packets_ecn;
+        tp->packets_processed += tp->db2->packets_exact + tp->db2->packets_sampled;
 
         printf("Total throughput: %lu bits/sec\n", (rate_nonecn + rate_ecn));
 
@@ -568,7 +1929,10 @@ void *printInfo(void *)
             break;
         }
 
-        tp->db2->init(); // init outside the critical area to save time
+        initDB2(); // init outside the critical area to save time
+        reloadTags(tp->sample_id + 2); // the next sample is being counted already
+        if (tp->trace != NULL)
+            tp->trace->maintain();
 
         elapsed = getStamp() - tp->start;
         next = ((uint64_t) tp->sample_id + 2) * tp->m_sinterval * 1000; // convert ms to us
@@ -577,7 +1941,7 @@ void *printInfo(void *)
         if (elapsed < next) {
             uint64_t sleeptime = next - elapsed;
             printf("Processed data in approx. %d us - sleeping for %d us\n", (int) process_time, (int) sleeptime);
-            wait(sleeptime * NSEC_PER_US);
+            waitUntil(tp->start + next);
         }
 
         if (tp->quit) {
@@ -606,6 +1970,55 @@ void *printInfo(void *)
     f_drops_nonecn.close();
     f_marks_ecn.close();
     f_rate.close();
+    f_sample_boundaries.close();
+    f_fairness_ecn.close();
+    f_fairness_nonecn.close();
+    f_fairness_ratio.close();
+
+    if (tp->db1->hh_ecn != NULL) {
+        f_topk_ecn.close();
+        f_topk_nonecn.close();
+    }
+
+    if (tp->spike_qdelay != 0)
+        f_events.close();
+    if (tp->sample_n > 1)
+        f_sampling.close();
+    for (uint32_t i = 0; i < tp->db2->nr_classes; ++i)
+        f_classes[i].close();
+
+    if (tp->m_descr_ack != NULL) {
+        f_rtt_ecn.close();
+        f_rtt_nonecn.close();
+    }
+
+    if (tp->tcp_loss) {
+        f_loss_ecn.close();
+        f_loss_nonecn.close();
+    }
+
+    // the columns of the tagged files
+    if (tp->tags != NULL) {
+        f_rate_tagged.close();
+        f_drops_tagged.close();
+        f_marks_tagged.close();
+
+        std::ofstream f_tags; openFileW(f_tags, tp->m_folder + "/tags");
+        for (auto const& name: tp->tags->names)
+            f_tags << name << std::endl;
+        f_tags.close();
+
+        std::ofstream f_tags_complete; openFileW(f_tags_complete, tp->m_folder + "/tags_complete");
+        f_tags_complete << tp->tags_complete << std::endl;
+        f_tags_complete.close();
+    }
+
+    // the last rollup may cover fewer samples
+    for (Rollup *r: tp->rollups) {
+        if (r->nsamples > 0)
+            r->write(tp->sample_times.back());
+        r->close();
+    }
 
     // write per flow stats
     // (we wait till here because we don't know how many
@@ -620,6 +2033,7 @@ void *printInfo(void *)
     //       the numbers include whichever packet was handled before this
     //       in the same queue
     //       e.g. a drop might be for another flow
+    //       (-L gives the losses of each TCP flow, see writeFlowsLoss)
 
     for (int i = 0; i < tp->sample_times.size(); i++) {
         f_flows_rate_ecn << i << " " << tp->sample_times[i];
@@ -629,15 +2043,17 @@ void *printInfo(void *)
         f_flows_rate_nonecn << i << " " << tp->sample_times[i];
         f_flows_drops_nonecn << i << " " << tp->sample_times[i];
 
-        for (auto const& kv: tp->fd_pf_ecn) {
-            f_flows_rate_ecn << " " << kv.second.at(i).rate;
-            f_flows_drops_ecn << " " << kv.second.at(i).drops;
-            f_flows_marks_ecn << " " << kv.second.at(i).marks;
+        for (auto const& kv: tp->fd_pf_ecn.columns) {
+            const FlowData &fd = tp->fd_pf_ecn.at(i, kv.second);
+            f_flows_rate_ecn << " " << fd.rate;
+            f_flows_drops_ecn << " " << fd.drops;
+            f_flows_marks_ecn << " " << fd.marks;
         }
 
-        for (auto const& kv: tp->fd_pf_nonecn) {
-            f_flows_rate_nonecn << " " << kv.second.at(i).rate;
-            f_flows_drops_nonecn << " " << kv.second.at(i).drops;
+        for (auto const& kv: tp->fd_pf_nonecn.columns) {
+            const FlowData &fd = tp->fd_pf_nonecn.at(i, kv.second);
+            f_flows_rate_nonecn << " " << fd.rate;
+            f_flows_drops_nonecn << " " << fd.drops;
         }
 
         f_flows_rate_ecn << std::endl;
@@ -654,15 +2070,29 @@ void *printInfo(void *)
     f_flows_drops_nonecn.close();
     f_flows_marks_ecn.close();
 
+    if (tp->db1->max_flow_hists > 0) {
+        writeFlowsQdelay("p50", &FlowData::qdelay_p50);
+        writeFlowsQdelay("p90", &FlowData::qdelay_p90);
+        writeFlowsQdelay("p99", &FlowData::qdelay_p99);
+    }
+
+    if (tp->m_descr_ack != NULL)
+        writeFlowsRtt();
+    if (tp->tcp_loss)
+        writeFlowsLoss();
+
+    for (uint32_t i = 0; i < tp->fd_pf_class.size(); ++i)
+        writeClassFlows(tp->m_folder + "/class_" + tp->classifier->names[i], tp->fd_pf_class[i]);
+
     // save flow details
     std::ofstream f_flows_ecn;    openFileW(f_flows_ecn,    tp->m_folder + "/flows_ecn");
     std::ofstream f_flows_nonecn; openFileW(f_flows_nonecn, tp->m_folder + "/flows_nonecn");
 
-    for (auto const& kv: tp->fd_pf_ecn) {
+    for (auto const& kv: tp->fd_pf_ecn.columns) {
         f_flows_ecn << getProtoRepr(kv.first.m_proto) << " " << IPtoString(kv.first.m_srcip) << " " << kv.first.m_srcport << " " << IPtoString(kv.first.m_dstip) << " " << kv.first.m_dstport << std::endl;
     }
 
-    for (auto const& kv: tp->fd_pf_nonecn) {
+    for (auto const& kv: tp->fd_pf_nonecn.columns) {
         f_flows_nonecn << getProtoRepr(kv.first.m_proto) << " " << IPtoString(kv.first.m_srcip) << " " << kv.first.m_srcport << " " << IPtoString(kv.first.m_dstip) << " " << kv.first.m_dstport << std::endl;
     }
 
@@ -6,24 +6,97 @@
 #include <pcap.h> /* if this gives you an error try pcap/pcap.h */
 #include <pthread.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/time.h>
 #include <string.h>
 #include <vector>
+#include <fstream>
+#include <sstream>
 
-#define QS_LIMIT 2048
-#define PDF_UPPERLIM 500
+#include "flowtable.h"
+#include "sketch.h"
+
+typedef u_int32_t u32; // we use "kernel-style" u32 variables in numbers.h
+#define TESTBED_ANALYZER 1
+#include "numbers.h" // metrics layout, see METRICS_FLAGS in the Makefile
+
+#define QS_LIMIT QDELAY_CODES // one bin for every encoded qdelay value
+#define FLOW_QS_PRECISION 2
+#define FLOW_QS_BINS (1 << (FLOW_QS_PRECISION + QDELAY_E)) // bins in the per flow queue delay histograms
 #define NSEC_PER_SEC 1000000000UL
 #define NSEC_PER_MS 1000000UL
 #define US_PER_S 1000000UL
 #define NSEC_PER_US 1000UL
+#define EVENT_HOLD_SAMPLES 10 // fine samples written before and after an event
+#define RTT_TS_SLOTS 8 // outstanding TCP timestamps kept per flow and direction
+#define FLOW_IDLE_SAMPLES 50 // samples without packets before the RTT and TCP loss state of a flow is dropped
+#define TAG_MAX 64 // tags in the tag rules, including the default tag
+#define TAG_RULES_MAX 255
+#define TAG_DEFAULT "Other" // tag of flows not matching any rule
+#define SPIKE_EVENTS_MAX 256 // queue delay spikes kept per sample
+#define CLASSES_MAX 32 // queues of the scheduler with -Q, including the default class
+#define CLASS_DEFAULT "other" // class of packets not matching any with -Q
+#define SAMPLE_MAX 4096 // packets per sampled packet, so a weighted packet fits in 32 bits
+#define SPIKE_EWMA_SHIFT 4 // weight 1/16 of each packet in the queue delay EWMA
+#define TCP_REORDER_PACKETS 3 // packets after a sequence hole before it is lost, as the TCP dupthresh
+#define TCP_REORDER_US 1000   // or time, well below the RTTs of the tests
+
+// IP address, IPv4 addresses are stored IPv4-mapped (::ffff:a.b.c.d)
+// so both families can be used as flow keys
+struct IPAddr {
+public:
+    uint32_t w[4]; // network byte order
+
+    IPAddr() {
+        w[0] = w[1] = w[2] = w[3] = 0;
+    }
+
+    IPAddr(in_addr_t ip4) {
+        w[0] = 0;
+        w[1] = 0;
+        w[2] = htonl(0xffff);
+        w[3] = ip4;
+    }
+
+    IPAddr(const uint8_t *ip6) {
+        memcpy(w, ip6, 16);
+    }
+
+    bool isV4() const {
+        return w[0] == 0 && w[1] == 0 && w[2] == htonl(0xffff);
+    }
+
+    bool operator<(const IPAddr &rhs) const {
+        for (int i = 0; i < 4; ++i) {
+            if (w[i] != rhs.w[i])
+                return w[i] < rhs.w[i];
+        }
+        return false;
+    }
+
+    bool operator==(const IPAddr &rhs) const {
+        return w[3] == rhs.w[3] && w[2] == rhs.w[2] &&
+               w[1] == rhs.w[1] && w[0] == rhs.w[0];
+    }
+
+    bool operator!=(const IPAddr &rhs) const {
+        return !(*this == rhs);
+    }
+
+    uint64_t fold() const {
+        return ((uint64_t) (w[0] ^ w[2]) << 32) | (w[1] ^ w[3]);
+    }
+};
 
 struct SrcDst {
 public:
-    SrcDst(uint8_t proto, in_addr_t srcip, uint16_t srcport, in_addr_t dstip, uint16_t dstport)
-      : m_proto(proto), m_srcip(srcip), m_srcport(srcport), m_dstip(dstip), m_dstport(dstport) {}
+    SrcDst() : m_proto(0), m_srcport(0), m_dstport(0) {}
+
+    SrcDst(uint8_t proto, const IPAddr &srcip, uint16_t srcport, const IPAddr &dstip, uint16_t dstport)
+      : m_proto(proto), m_srcip(srcip), m_dstip(dstip), m_srcport(srcport), m_dstport(dstport) {}
 
     uint8_t m_proto;
-    in_addr_t m_srcip, m_dstip;
+    IPAddr m_srcip, m_dstip;
     uint16_t m_srcport, m_dstport;
 
     bool operator<(const SrcDst& rhs) const {
@@ -39,11 +112,25 @@ public:
     }
 
     bool operator==(const SrcDst &rhs) const {
-        return m_srcip == rhs.m_srcip &&
+        return m_proto == rhs.m_proto &&
+               m_srcip == rhs.m_srcip &&
                m_dstip == rhs.m_dstip &&
                m_srcport == rhs.m_srcport &&
                m_dstport == rhs.m_dstport;
     }
+
+    uint64_t hash() const {
+        uint64_t h = m_srcip.fold() * 0x9e3779b97f4a7c15ULL;
+        h = (h ^ m_dstip.fold()) * 0x9e3779b97f4a7c15ULL;
+        h ^= ((uint64_t) m_proto << 32) | ((uint32_t) m_srcport << 16) | m_dstport;
+
+        // murmur3 finalizer, so all bits depend on all fields
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        return h ^ (h >> 33);
+    }
 };
 
 struct FlowData {
@@ -52,96 +139,805 @@ public:
         rate = r;
         drops = d;
         marks = m;
+        packets = 1;
+        hist = -1;
+        qdelay_p50 = -1;
+        qdelay_p90 = -1;
+        qdelay_p99 = -1;
+        rtt_sum = 0;
+        rtt_n = 0;
+        loss = 0;
+        retrans = 0;
     }
 
-    FlowData() : rate(0), drops(0), marks(0) {}
+    FlowData() : rate(0), drops(0), marks(0), packets(0), hist(-1),
+                 qdelay_p50(-1), qdelay_p90(-1), qdelay_p99(-1),
+                 rtt_sum(0), rtt_n(0), loss(0), retrans(0) {}
 
     void update(uint32_t r, uint32_t d, uint32_t m) {
         rate += r;
         drops += d;
         marks += m;
+        packets++;
     }
 
     void clear() {
         rate = 0;
         drops = 0;
         marks = 0;
+        packets = 0;
+        loss = 0;
+        retrans = 0;
     }
 
     uint64_t rate;
     uint32_t drops;
     uint32_t marks;
+    uint32_t packets; // counted in the sample, 0 for flows given a histogram before their first packet
+
+    // index in DataBlock::flow_hists while capturing, -1 if the flow
+    // did not get a queue delay histogram
+    int32_t hist;
+
+    // queue delay percentiles in us, filled in when the sample is
+    // processed (-1 if the flow had no histogram)
+    int32_t qdelay_p50;
+    int32_t qdelay_p90;
+    int32_t qdelay_p99;
+
+    // RTT samples of the flow in us, see RttState
+    uint64_t rtt_sum;
+    uint32_t rtt_n;
+
+    // average RTT in us, -1 without samples
+    int64_t rttAvg() const {
+        return rtt_n == 0 ? -1 : rtt_sum / rtt_n;
+    }
+
+    // TCP segments lost before the capture point and retransmitted
+    // ones, see TcpSeqState
+    uint32_t loss;
+    uint32_t retrans;
+};
+
+// TCP timestamps (TSval) seen in one direction of a flow, with the time
+// each was first seen, waiting to be echoed (TSecr) in the other
+// direction. At most RTT_TS_SLOTS are outstanding, new values are
+// skipped while it is full, so there are up to that many RTT samples
+// per RTT whatever the timestamp clock rate is.
+struct TsRing {
+public:
+    uint32_t tsval[RTT_TS_SLOTS];
+    uint64_t time[RTT_TS_SLOTS]; // us
+    uint32_t head; // oldest outstanding value
+    uint32_t n;
+    uint32_t last; // last value seen, recorded or not
+
+    TsRing() : head(0), n(0), last(0) {}
+
+    void add(uint32_t ts, uint64_t t) {
+        // packets sent in the same clock tick share the TSval, and only
+        // the first one is used
+        if (ts == last)
+            return;
+        last = ts;
+        if (n == RTT_TS_SLOTS)
+            return;
+        uint32_t slot = (head + n) % RTT_TS_SLOTS;
+        tsval[slot] = ts;
+        time[slot] = t;
+        n++;
+    }
+
+    // time the echoed value was first seen. The value and the older ones
+    // are forgotten, so only the first echo is used.
+    bool match(uint32_t tsecr, uint64_t *t) {
+        for (uint32_t i = 0; i < n; ++i) {
+            uint32_t slot = (head + i) % RTT_TS_SLOTS;
+            if (tsval[slot] == tsecr) {
+                *t = time[slot];
+                head = (slot + 1) % RTT_TS_SLOTS;
+                n -= i + 1;
+                return true;
+            }
+        }
+
+        // the outstanding values will never be echoed if a newer one was
+        if (n > 0 && (int32_t) (tsecr - tsval[(head + n - 1) % RTT_TS_SLOTS]) > 0)
+            n = 0;
+        return false;
+    }
+};
+
+// Passive RTT estimation of a TCP flow from its timestamps, seen from
+// the capture point. A TSval in the data direction echoed by an ACK
+// gives the time to the receiver and back (down), and a TSval in an ACK
+// echoed by data gives the time to the sender and back, which includes
+// the queue we measure (up). Their sum is the RTT of the flow.
+struct RttState {
+public:
+    TsRing data;
+    TsRing ack;
+    int64_t down; // us, -1 until measured
+    int64_t up;
+    uint32_t seen; // ThreadParam::swaps at the last packet in either direction
 
+    RttState() : down(-1), up(-1), seen(0) {}
+};
+
+enum TcpSeqKind {
+    TCP_SEQ_NEW,
+    TCP_SEQ_RETRANS,
+    TCP_SEQ_REORDERED,
+};
+
+// Losses of a TCP flow before the capture point, from the sequence
+// numbers of its data. A segment above the highest one seen opens a
+// hole of the segments in between, which is lost once
+// TCP_REORDER_PACKETS packets or TCP_REORDER_US have passed, and
+// segments filling it before that were only reordered. Other segments
+// below the highest one are retransmissions. Only the last hole is
+// kept, so each packet is O(1), and the previous hole is lost when a
+// new one opens.
+struct TcpSeqState {
+public:
+    uint32_t next;       // sequence number after the highest seen
+    uint32_t hole_start;
+    uint32_t hole_end;
+    uint32_t hole_segs;  // segments missing in the pending hole, 0 if none
+    uint32_t after;      // packets since the hole opened
+    uint64_t hole_time;  // us
+    uint32_t seg_max;    // largest segment, for the segments in a hole
+    uint32_t seen;       // ThreadParam::swaps at the last packet
+    bool valid;
+
+    TcpSeqState() : next(0), hole_start(0), hole_end(0), hole_segs(0), after(0),
+                    hole_time(0), seg_max(0), seen(0), valid(false) {}
+
+    // a segment of len sequence numbers (with SYN and FIN) at seq,
+    // adds the segments now known to be lost to *lost
+    TcpSeqKind add(uint32_t seq, uint32_t len, bool syn, uint64_t now, uint32_t *lost) {
+        if (len > seg_max)
+            seg_max = len;
+        if (!valid || syn) {
+            valid = true;
+            next = seq + len;
+            hole_segs = 0;
+            return TCP_SEQ_NEW;
+        }
+
+        // too late to be reordered
+        if (hole_segs != 0 && now - hole_time > TCP_REORDER_US) {
+            *lost += hole_segs;
+            hole_segs = 0;
+        }
+
+        TcpSeqKind kind = TCP_SEQ_NEW;
+        int32_t d = seq - next;
+        if (d > 0) {
+            *lost += hole_segs;
+            hole_start = next;
+            hole_end = seq;
+            hole_segs = (d + seg_max - 1) / seg_max;
+            after = 0;
+            hole_time = now;
+            next = seq + len;
+            return kind;
+        }
+
+        if (d < 0) {
+            if (hole_segs != 0 && (int32_t) (seq - hole_start) >= 0 && (int32_t) (seq - hole_end) < 0) {
+                kind = TCP_SEQ_REORDERED;
+                hole_segs--;
+            } else {
+                kind = TCP_SEQ_RETRANS;
+            }
+        }
+        if ((int32_t) (seq + len - next) > 0)
+            next = seq + len;
+
+        if (hole_segs != 0 && ++after >= TCP_REORDER_PACKETS) {
+            *lost += hole_segs;
+            hole_segs = 0;
+        }
+        return kind;
+    }
+};
+
+// TCP losses in a queue, see TcpSeqState
+struct LossTotals {
+public:
+    uint64_t lost;      // segments
+    uint64_t retrans;   // packets
+    uint64_t reordered; // packets
+
+    void init() {
+        lost = 0;
+        retrans = 0;
+        reordered = 0;
+    }
 };
 
 struct FlowMap {
 public:
-    std::map<SrcDst,FlowData> ecn_rate;
-    std::map<SrcDst,FlowData> nonecn_rate;
+    FlowTable<SrcDst,FlowData> ecn_rate;
+    FlowTable<SrcDst,FlowData> nonecn_rate;
     void init(){
-        ecn_rate.clear();
-        nonecn_rate.clear();
-        /*for (std::map<SrcDst,FlowData>::iterator it = ecn_rate.begin(); it != ecn_rate.end(); ++it)
-            it->second.clear();
-        for (std::map<SrcDst,FlowData>::iterator it = nonecn_rate.begin(); it != nonecn_rate.end(); ++it)
-            it->second.clear();*/
+        ecn_rate.init();
+        nonecn_rate.init();
+    }
+};
+
+// Layout of the queue delay histograms
+//
+// The encoded qdelay value (QDELAY_M mantissa and QDELAY_E exponent bits)
+// is already a log-linear (HDR style) histogram index. The layout keeps
+// `precision` of the mantissa bits and puts everything above `range` us
+// in the last bin, so the number of bins (memory per sample and columns
+// in the output) can be tuned per test. The default layout keeps all
+// QS_LIMIT bins as they are encoded.
+struct QdelayLayout {
+public:
+    uint32_t precision; // mantissa bits kept, at most QDELAY_M
+    uint32_t range;     // upper limit in us, 0 for no limit
+    uint32_t nbins;
+    uint16_t bin[QS_LIMIT]; // encoded qdelay -> histogram bin
+    int lower[QS_LIMIT];    // histogram bin -> lowest queue delay in us
+
+    void init(uint32_t precision, uint32_t range);
+};
+
+// compact queue delay histogram for a single flow, using a layout
+// with FLOW_QS_PRECISION mantissa bits
+struct FlowHist {
+public:
+    uint32_t bins[FLOW_QS_BINS];
+
+    void init() {
+        bzero(bins, FLOW_QS_BINS*sizeof(uint32_t));
     }
+
+    int percentile(double p, const QdelayLayout &layout) const;
 };
 
 struct QueueSize {
 public:
-    uint32_t ecn00[QS_LIMIT];
-    uint32_t ecn01[QS_LIMIT];
-    uint32_t ecn10[QS_LIMIT];
-    uint32_t ecn11[QS_LIMIT];
+    uint32_t nbins;
+    uint32_t *ecn00;
+    uint32_t *ecn01;
+    uint32_t *ecn10;
+    uint32_t *ecn11;
+
+    QueueSize(uint32_t n) : nbins(n) {
+        ecn00 = new uint32_t[nbins];
+        ecn01 = new uint32_t[nbins];
+        ecn10 = new uint32_t[nbins];
+        ecn11 = new uint32_t[nbins];
+    }
 
     void init(){
-        bzero(ecn00,QS_LIMIT*sizeof(uint32_t));
-        bzero(ecn01,QS_LIMIT*sizeof(uint32_t));
-        bzero(ecn10,QS_LIMIT*sizeof(uint32_t));
-        bzero(ecn11,QS_LIMIT*sizeof(uint32_t));
+        bzero(ecn00,nbins*sizeof(uint32_t));
+        bzero(ecn01,nbins*sizeof(uint32_t));
+        bzero(ecn10,nbins*sizeof(uint32_t));
+        bzero(ecn11,nbins*sizeof(uint32_t));
+    }
+
+    void add(const QueueSize &other){
+        for (uint32_t i = 0; i < nbins; ++i) {
+            ecn00[i] += other.ecn00[i];
+            ecn01[i] += other.ecn01[i];
+            ecn10[i] += other.ecn10[i];
+            ecn11[i] += other.ecn11[i];
+        }
+    }
+
+    // highest bin with packets, -1 if empty
+    int maxBin() const {
+        for (int i = nbins - 1; i >= 0; --i)
+            if (ecn00[i] | ecn01[i] | ecn10[i] | ecn11[i])
+                return i;
+        return -1;
+    }
+};
+
+// tunables given as options on the command line
+struct Options {
+public:
+    uint32_t qdelay_precision;
+    uint32_t qdelay_range;
+    uint32_t flow_hists;
+    uint32_t topk;
+    uint32_t snaplen;
+    std::string drop_counters; // file with exact drop counters, empty if none
+    bool verbose; // print every flow for each sample
+    std::vector<uint32_t> rollups; // samples in each coarser resolution
+    uint32_t event_qdelay; // only write samples near queue delays above this (us)
+    uint32_t event_drops;  // or near samples with this many drops, 0 for none
+    int capture_cpu; // cpu to pin the capture thread to, -1 for any
+    int report_cpu;  // cpu to pin the reporting thread to, -1 for any
+    bool realtime;   // run the reporting thread with SCHED_FIFO
+    std::string bpf_mode; // "tc", "tc-ingress" or "xdp" for in-kernel aggregation, empty for pcap
+    std::string ack_filter; // pcap filter for the ACKs, to estimate RTTs, empty for none
+    std::string tag_rules;  // file with traffic= lines to tag flows by, empty for none
+    std::string trace_folder; // per packet trace (see trace.h), empty for none
+    uint32_t trace_mb;        // size of each trace file
+    uint32_t trace_keep;      // trace files kept, 0 for all
+    uint32_t spike_qdelay; // write queue delay spikes above this (us) to events, 0 for none
+    uint32_t spike_window; // us below it that end a spike
+    uint32_t sample_n;     // count 1 in n of the packets without drops or marks
+    std::string queue_classes; // QueueClassifier spec, empty for only ECN
+    bool tcp_loss;             // detect TCP losses from the sequence numbers
+    std::string ingress_dev;   // capture before the AQM for the sojourn time, empty for none
+    uint32_t sojourn_timeout;  // ms before a packet not seen at egress is a drop
+
+    Options();
+};
+
+// Per flow data of all samples. Each sample is a row with a column for
+// every flow seen so far, and the rows are stored after each other in one
+// array, so the flows of a sample are contiguous and a new sample doesn't
+// touch the history of every flow. Flows first seen in later samples are
+// missing from the earlier rows, and read as FlowData().
+struct FlowHistory {
+public:
+    std::map<SrcDst,uint32_t> columns; // flow -> column, in flow order
+    std::vector<std::string> labels;   // column -> flow formatted for printing
+    std::vector<FlowData> data;
+    std::vector<size_t> row_start;     // sample -> offset in data
+
+    void newSample() {
+        row_start.push_back(data.size());
     }
+
+    // adds a flow to the last sample, returns its column
+    uint32_t add(const SrcDst &srcdst, const FlowData &fd);
+
+    const FlowData &at(uint32_t sample, uint32_t column) const {
+        static const FlowData none;
+        if (sample >= row_start.size())
+            return none;
+        size_t end = sample + 1 < row_start.size() ? row_start[sample + 1] : data.size();
+        size_t i = row_start[sample] + column;
+        return i < end ? data[i] : none;
+    }
+};
+
+// exact totals for all flows in a queue
+struct ClassTotals {
+public:
+    uint64_t rate; // bits
+    uint64_t drops;
+    uint64_t marks;
+
+    void init() {
+        rate = 0;
+        drops = 0;
+        marks = 0;
+    }
+};
+
+// Tags of the test traffic by port, as given by the traffic= lines of the
+// details file, e.g. "traffic=tcp type=greedy node=AA server=5500 tag=A".
+// A rule matches the destination port with client=, or the source port
+// with server=, and the first matching rule gives the tag. The rules are
+// compiled into a table for each port, holding the first rule using it,
+// so a lookup is two loads whatever the number of rules.
+struct TagRules {
+public:
+    std::vector<std::string> names; // tag id -> name, 0 is TAG_DEFAULT
+    uint8_t client[65536]; // destination port -> first rule + 1, 0 for none
+    uint8_t server[65536]; // source port -> first rule + 1, 0 for none
+    uint8_t rule_tag[TAG_RULES_MAX + 1]; // rule + 1 -> tag id, 0 for none
+    uint32_t nrules;
+
+    uint8_t lookup(const SrcDst &sd) const {
+        uint8_t c = client[sd.m_dstport];
+        uint8_t s = server[sd.m_srcport];
+        uint8_t rule = (c != 0 && (s == 0 || c < s)) ? c : s;
+        return rule_tag[rule];
+    }
+
+    // reads the rules from file, keeping the tag ids of prev (if not
+    // NULL) so the columns of the output don't change
+    bool load(const std::string &file, const TagRules *prev);
+};
+
+// Classifiers for processPacket, which is compiled for each of them.
+// The ECN bits (or address bits with ipclass) always give the ECN and
+// non-ECN files, and only that is done with EcnClassifier, so the
+// default path is the same as without classifiers. QueueClassifier adds
+// the N queues of a scheduler that classifies by DSCP or port (-Q),
+// counted in DataBlock::classes.
+struct EcnClassifier {
+public:
+    static const bool has_classes = false;
+
+    uint32_t classify(uint8_t, const SrcDst &) const {
+        return 0;
+    }
+};
+
+struct QueueClassifier {
+public:
+    static const bool has_classes = true;
+
+    std::vector<std::string> names; // class -> name
+    uint32_t other; // class of packets matching none, CLASS_DEFAULT
+    bool by_port;   // by DSCP otherwise
+    uint8_t dscp[64];     // DSCP -> class
+    uint8_t port[65536];  // source or destination port -> class + 1, 0 for none
+
+    uint32_t classify(uint8_t tos, const SrcDst &sd) const {
+        if (!by_port)
+            return dscp[tos >> 2];
+        // the source port first, which is the server port of the test
+        // traffic going to the clients
+        uint8_t c = port[sd.m_srcport];
+        if (c == 0)
+            c = port[sd.m_dstport];
+        return c == 0 ? other : c - 1;
+    }
+
+    // spec is "dscp:" or "port:" followed by the classes separated by
+    // commas, each one value or range (port) or several joined with +,
+    // e.g. "dscp:46,10+12+14" or "port:5000-5099,5100-5199"
+    bool parse(const std::string &spec);
+};
+
+// Counters of one class of QueueClassifier
+struct ClassStats {
+public:
+    uint32_t *qs;   // packets in each queue delay bin
+    uint32_t *d_qs; // drops in each queue delay bin
+    FlowTable<SrcDst,FlowData> fm;
+    ClassTotals tot;
+    uint64_t packets;
+};
+
+// RTT samples of all flows in a queue
+struct RttTotals {
+public:
+    uint64_t sum; // us
+    uint64_t n;
+    uint64_t min;
+    uint64_t max;
+
+    void init() {
+        sum = 0;
+        n = 0;
+        min = UINT64_MAX;
+        max = 0;
+    }
+
+    void add(uint64_t rtt) {
+        sum += rtt;
+        n++;
+        if (rtt < min)
+            min = rtt;
+        if (rtt > max)
+            max = rtt;
+    }
+};
+
+// A queue delay spike in one queue, from the first to the last packet
+// with queue delay above the threshold
+struct SpikeEvent {
+public:
+    uint64_t start;    // capture time in us
+    uint32_t duration; // us
+    uint32_t peak;     // highest queue delay in us
+    uint32_t ewma;     // queue delay EWMA in us before the spike
+    uint32_t packets;
+    uint32_t drops;
+    bool ecn;
+};
+
+// Finds queue delay spikes shorter than the sample interval, which are
+// averaged away in the histograms. A spike starts with a packet with
+// queue delay at or above the threshold, and ends when the max queue
+// delay over the last `window` us is below it, which is known from the
+// time of the last packet above the threshold, so each packet is O(1).
+// The EWMA of the queue delay (per packet) tells bursts into an empty
+// queue from spikes on top of a standing queue.
+struct SpikeDetector {
+public:
+    uint32_t ewma; // us << SPIKE_EWMA_SHIFT
+    bool active;
+    uint64_t last_above; // us
+    uint32_t packets;    // since the spike started
+    uint32_t drops;
+    SpikeEvent ev;
+
+    SpikeDetector() : ewma(0), active(false), last_above(0), packets(0), drops(0) {}
+
+    // ends the spike if no packet was above the threshold in the last
+    // window, true if it did (it is then in ev)
+    bool expire(uint64_t now, uint32_t window) {
+        if (!active || now - last_above <= window)
+            return false;
+        active = false;
+        return true;
+    }
+
+    // w is the sampling weight of the packet
+    void add(uint64_t now, uint32_t qdelay, uint32_t d, uint32_t w, uint32_t threshold) {
+        if (qdelay >= threshold && !active) {
+            active = true;
+            ev.start = now;
+            ev.peak = 0;
+            ev.ewma = ewma >> SPIKE_EWMA_SHIFT;
+            packets = 0;
+            drops = 0;
+        }
+
+        if (active) {
+            packets += w;
+            drops += d;
+            if (qdelay >= threshold) {
+                // the spike is counted up to the last packet above it
+                last_above = now;
+                ev.duration = now - ev.start;
+                ev.packets = packets;
+                ev.drops = drops;
+                if (qdelay > ev.peak)
+                    ev.peak = qdelay;
+            }
+        }
+
+        ewma += qdelay - (ewma >> SPIKE_EWMA_SHIFT);
+    }
+};
+
+// Exact drop totals exported by the schedulers (see testbed_seq_show in
+// testbed.h), used instead of the drops carried in the packets which are
+// limited by the encoding
+struct DropCounters {
+public:
+    std::string file;
+    uint64_t ecn;    // totals at the last read
+    uint64_t nonecn;
+    bool valid;      // the last read succeeded
+
+    // reads the totals and gives the drops since the last read,
+    // false if the file can't be read or this is the first read
+    bool read(uint64_t *d_ecn, uint64_t *d_nonecn);
 };
 
 struct DataBlock {
 public:
+    DataBlock(uint32_t nbins, const Options &opts, uint32_t nclasses = 0) : qs(nbins), d_qs(nbins) {
+        max_flow_hists = opts.flow_hists;
+        flow_hists = new FlowHist[max_flow_hists];
+        nr_flow_hists = max_flow_hists; // clear all on first init
+
+        hh_ecn = NULL;
+        hh_nonecn = NULL;
+        if (opts.topk > 0) {
+            hh_ecn = new HeavyHitters<SrcDst>(opts.topk);
+            hh_nonecn = new HeavyHitters<SrcDst>(opts.topk);
+        }
+
+        nr_classes = nclasses;
+        classes = new ClassStats[nr_classes];
+        for (uint32_t i = 0; i < nr_classes; ++i) {
+            classes[i].qs = new uint32_t[nbins];
+            classes[i].d_qs = new uint32_t[nbins];
+        }
+    }
+
     struct QueueSize qs;
     struct QueueSize d_qs; // total number of drops for each queue size
     struct FlowMap fm;
+
+    // per flow queue delay histograms, handed out to flows until
+    // max_flow_hists is reached
+    FlowHist *flow_hists;
+    uint32_t max_flow_hists;
+    uint32_t nr_flow_hists;
+
+    // approximate per flow accounting used instead of fm when
+    // tracking top-K flows (NULL otherwise)
+    HeavyHitters<SrcDst> *hh_ecn;
+    HeavyHitters<SrcDst> *hh_nonecn;
+    ClassTotals ecn_tot;
+    ClassTotals nonecn_tot;
+    RttTotals ecn_rtt;
+    RttTotals nonecn_rtt;
+    LossTotals ecn_loss;
+    LossTotals nonecn_loss;
+    ClassTotals tag_tot[TAG_MAX]; // by tag id, if tags are used
+    ClassStats *classes; // by QueueClassifier class, if used
+    uint32_t nr_classes;
+    SpikeEvent events[SPIKE_EVENTS_MAX]; // spikes that ended in the sample, if detected
+    uint32_t nr_events;
+    uint32_t events_lost; // spikes beyond SPIKE_EVENTS_MAX
+
     uint64_t start; // time in us
     uint64_t last;  // time in us
     uint64_t tot_packets_ecn;
     uint64_t tot_packets_nonecn;
+    uint64_t packets_exact;   // counted once (weight 1)
+    uint64_t packets_sampled; // counted sample_n times, standing for the ones skipped
+
+    void addEvent(const SpikeEvent &ev) {
+        if (nr_events < SPIKE_EVENTS_MAX)
+            events[nr_events++] = ev;
+        else
+            events_lost++;
+    }
 
     void init(){
         qs.init();
         d_qs.init();
         fm.init();
+        for (uint32_t i = 0; i < nr_flow_hists; ++i)
+            flow_hists[i].init();
+        nr_flow_hists = 0;
+        if (hh_ecn != NULL) {
+            hh_ecn->init();
+            hh_nonecn->init();
+        }
+        ecn_tot.init();
+        nonecn_tot.init();
+        ecn_rtt.init();
+        nonecn_rtt.init();
+        ecn_loss.init();
+        nonecn_loss.init();
+        for (int i = 0; i < TAG_MAX; ++i)
+            tag_tot[i].init();
+        nr_events = 0;
+        events_lost = 0;
+        for (uint32_t i = 0; i < nr_classes; ++i) {
+            ClassStats &c = classes[i];
+            bzero(c.qs, qs.nbins * sizeof(uint32_t));
+            bzero(c.d_qs, qs.nbins * sizeof(uint32_t));
+            c.fm.init();
+            c.tot.init();
+            c.packets = 0;
+        }
         tot_packets_ecn = 0;
         tot_packets_nonecn = 0;
+        packets_exact = 0;
+        packets_sampled = 0;
     }
 };
 
+// The queue and rate files at a coarser resolution, summed up from
+// `factor` samples at a time and written to their own folder
+struct Rollup {
+public:
+    Rollup(uint32_t f, uint32_t nbins) : factor(f), qs(nbins), d_qs(nbins) {}
+
+    uint32_t factor;
+    uint32_t id;       // sample number at this resolution
+    uint32_t nsamples; // samples summed since the last write
+    uint64_t len;      // time covered by them in us
+    QueueSize qs;
+    QueueSize d_qs;
+    ClassTotals ecn_tot;
+    ClassTotals nonecn_tot;
+    uint64_t packets_ecn;
+    uint64_t packets_nonecn;
+
+    std::ofstream f_queue_packets[4]; // ecn00 to ecn11
+    std::ofstream f_queue_drops[4];
+    std::ofstream f_rate_ecn;
+    std::ofstream f_rate_nonecn;
+    std::ofstream f_drops_ecn;
+    std::ofstream f_drops_nonecn;
+    std::ofstream f_marks_ecn;
+    std::ofstream f_rate;
+    std::ofstream f_packets_ecn;
+    std::ofstream f_packets_nonecn;
+
+    void open(const std::string &folder, const QdelayLayout &layout);
+    void init();
+    // drops are given separately as they may come from the drop counters
+    void add(const DataBlock *db, uint64_t drops_ecn, uint64_t drops_nonecn);
+    void write(uint64_t time_ms);
+    void close();
+};
+
+// The event gated files (-e, -D) of the last EVENT_HOLD_SAMPLES samples
+// without an event, written out when an event comes so the samples
+// leading up to it are there too. The files of a held sample write into
+// buffers instead.
+struct EventHold {
+public:
+    EventHold() : next(0), count(0) {}
+
+    void add(std::ostream &f);
+    void begin(); // the files write into the buffers of a new held sample
+    void end();   // and to the files again, the oldest held sample is dropped
+    void flush(); // writes the held samples to the files, oldest first
+
+private:
+    std::vector<std::ostream*> files;
+    std::vector<std::streambuf*> filebufs; // of the files while held
+    std::vector<std::stringbuf> held; // EVENT_HOLD_SAMPLES slots of a buffer for each file
+    uint32_t next;  // slot of the next held sample
+    uint32_t count; // held samples
+};
+
+// The files of a QueueClassifier class, written to the folder
+// class_<name> with the names of the files of the ECN queues, without
+// the queue in the name
+struct ClassFiles {
+public:
+    std::ofstream f_queue_packets;
+    std::ofstream f_queue_drops;
+    std::ofstream f_rate;
+    std::ofstream f_drops;
+    std::ofstream f_marks;
+    std::ofstream f_packets;
+
+    void open(const std::string &folder, const QdelayLayout &layout);
+    void write(const ClassStats &cs, int sample_id, uint64_t samplelen, uint64_t time_ms);
+    void close();
+};
+
+struct BpfBackend;
+struct TraceWriter;
+struct SojournMatcher;
+
 struct ThreadParam {
 public:
-    // table of qdelay values (no need to decode all the time..)
-    int qdelay_decode_table[QS_LIMIT];
-    
-    uint64_t packets_captured;
-    uint64_t packets_processed;
+    // maps encoded qdelay to histogram bins (no need to decode all the time..)
+    QdelayLayout layout;
+    QdelayLayout flow_layout;
+
+    uint64_t packets_captured;  // counted, under m_mutex
+    uint64_t packets_processed; // counted in a finished sample, without the sampling weights
+    uint64_t packets_nonip;     // frames without IPv4/IPv6, not processed
+    uint64_t packets_malformed; // truncated or invalid frames, not processed
     uint64_t start;
     pthread_mutex_t m_mutex;
     DataBlock *db1; // used by ProcessPacket
     DataBlock *db2; // used by printInfo
     pcap_t* m_descr;
+    BpfBackend *bpf; // used instead of m_descr with in-kernel aggregation, NULL otherwise
+    pcap_t* m_descr_ack; // ACKs of the captured flows for RTT estimation, NULL if not used
+    pcap_t* m_descr_ingress; // before the AQM with -I, m_descr is then after it
+    SojournMatcher *sojourn; // NULL if not used
+    FlowTable<SrcDst,RttState> rtt_flows; // by data direction, idle flows dropped at the sample swap
+    uint64_t rtt_flows_expired;
+    uint64_t packets_ack;
+    bool tcp_loss; // detect TCP losses from the sequence numbers
+    FlowTable<SrcDst,TcpSeqState> tcp_flows; // idle flows dropped at the sample swap
+    uint64_t tcp_flows_expired;
+    TraceWriter *trace; // NULL if not writing a per packet trace
+    uint32_t spike_qdelay; // 0 if not detecting spikes
+    uint32_t spike_window;
+    SpikeDetector spikes[2]; // nonecn and ecn queue
+    int64_t clock_offset; // CLOCK_REALTIME - CLOCK_MONOTONIC in us, for capture times
+    uint32_t sample_n;         // 1 if counting all packets
+    uint32_t sample_threshold; // a packet is counted if the random value is below this
+    uint64_t sample_rng;       // xorshift state, capture thread only
+    uint64_t packets_sampled_out; // skipped by sampling, capture thread only, not in packets_captured
+    QueueClassifier *classifier; // NULL for only ECN
+    std::vector<FlowHistory> fd_pf_class; // by class
+    TagRules *tags; // NULL if not tagging
+    std::string tags_file;
+    struct timespec tags_mtime; // of the file when the rules were read
+    int tags_complete; // first sample counted only with the last rules read
     uint32_t m_sinterval;
     std::string m_folder;
     bool ipclass;
     uint32_t m_nrs;
-    std::map<SrcDst,std::vector<FlowData>> fd_pf_ecn;
-    std::map<SrcDst,std::vector<FlowData>> fd_pf_nonecn;
-    ThreadParam(uint32_t sinterval, std::string folder, bool ipc, uint32_t nrs);
+    bool verbose;
+    std::vector<Rollup*> rollups;
+    uint32_t event_qdelay;
+    uint32_t event_drops;
+    int last_event; // sample id of the last event, -1 if none
+    int capture_cpu;
+    int report_cpu;
+    bool realtime;
+    DropCounters drop_counters;
+    FlowHistory fd_pf_ecn;
+    FlowHistory fd_pf_nonecn;
+    ThreadParam(uint32_t sinterval, std::string folder, bool ipc, uint32_t nrs, const Options &opts);
     void swapDB();
+    uint32_t swaps; // samples swapped, under m_mutex
     volatile bool quit;
     pthread_cond_t quit_cond;
     pthread_mutex_t quit_lock;
@@ -150,12 +946,28 @@ public:
 };
 
 uint64_t getStamp();
+#ifdef TA_COUNT_ALLOCS
+uint64_t getAllocations();
+#endif
+int decodeDrops(u32 value);
+const char *IPtoBuf(const IPAddr &ip, char *buf);
+std::string IPtoString(const IPAddr &ip);
+const char *getProtoRepr(uint8_t proto);
+
+// protocols we keep per flow statistics for
+static inline bool isFlowProto(uint8_t proto) {
+    return proto == IPPROTO_TCP || proto == IPPROTO_UDP ||
+           proto == IPPROTO_ICMP || proto == IPPROTO_ICMPV6;
+}
 
 void *pcapLoop(void *);
-int setup_pcap(ThreadParam *param, char *dev, std::string &pcapfilter);
+void *pcapLoopAck(void *);
+void *pcapLoopIngress(void *);
+int setup_pcap(ThreadParam *param, char *dev, std::string &pcapfilter, int snaplen);
+pcap_t *open_pcap(const char *dev, const std::string &pcapfilter, int snaplen);
 int start_analysis(ThreadParam *param);
 void processFD();
-void wait(uint64_t sleep_ns);
+void waitUntil(uint64_t deadline_us);
 void setThreadParam(ThreadParam *param);
 
 #endif // ANALYSIS_H
@@ -0,0 +1,142 @@
+// Times parsePacket on synthetic frames of each kind the analyzer
+// handles, see "make bench_parse". The IPv4 frames should stay on the
+// fast path, and the others show the cost of the slow path.
+//
+//   ./bench_parse [iterations]
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet.h"
+
+#define BENCH_ITERATIONS 10000000
+#define BENCH_FRAMES 64 // of each kind, with different addresses and ports
+#define BENCH_FRAME_LEN 128
+
+static volatile uint64_t bench_sink;
+
+struct BenchKind {
+public:
+    const char *name;
+    u_char frames[BENCH_FRAMES][BENCH_FRAME_LEN];
+    uint32_t caplen;
+};
+
+static uint64_t nsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// the ethernet header with the VLAN tags, returns the offset of the IP header
+static uint32_t addEthernet(u_char *f, int vlans, uint16_t ethertype)
+{
+    uint32_t off = 12;
+    for (int i = 0; i < vlans; ++i) {
+        f[off] = (i == 0 && vlans == 2) ? 0x88 : 0x81; // 802.1ad outer tag
+        f[off + 1] = (i == 0 && vlans == 2) ? 0xa8 : 0x00;
+        f[off + 3] = 10 + i; // VLAN id
+        off += VLAN_HLEN;
+    }
+    f[off] = ethertype >> 8;
+    f[off + 1] = ethertype & 0xff;
+    return off + 2;
+}
+
+static void addTcp(u_char *f, uint32_t off, int i)
+{
+    f[off] = (5000 + i) >> 8;
+    f[off + 1] = (5000 + i) & 0xff;
+    f[off + 2] = 40000 >> 8;
+    f[off + 3] = 40000 & 0xff;
+    f[off + 12] = 5 << 4; // data offset
+}
+
+static uint32_t buildIPv4(u_char *f, int vlans, int i)
+{
+    uint32_t off = addEthernet(f, vlans, ETHERTYPE_IP);
+    f[off] = 0x45;
+    f[off + 1] = 0x01; // ECT(1)
+    f[off + 2] = 1500 >> 8;
+    f[off + 3] = 1500 & 0xff;
+    f[off + 5] = i; // metrics in the id
+    f[off + 8] = 64;
+    f[off + 9] = IPPROTO_TCP;
+    f[off + 12] = 10; f[off + 13] = 187; f[off + 14] = 255; f[off + 15] = i;
+    f[off + 16] = 10; f[off + 17] = 187; f[off + 18] = 16; f[off + 19] = 1;
+    addTcp(f, off + 20, i);
+    return off + 20 + TCP_HLEN;
+}
+
+// with a hop-by-hop options header in front of TCP if ext
+static uint32_t buildIPv6(u_char *f, int vlans, bool ext, int i)
+{
+    uint32_t off = addEthernet(f, vlans, ETHERTYPE_IPV6);
+    f[off] = 0x60;
+    f[off + 3] = i; // metrics in the flow label
+    f[off + 4] = (1460 + (ext ? 8 : 0)) >> 8;
+    f[off + 5] = (1460 + (ext ? 8 : 0)) & 0xff;
+    f[off + 6] = ext ? (int) IPPROTO_HOPOPTS : (int) IPPROTO_TCP;
+    f[off + 7] = 64;
+    f[off + 8] = 0xfd; f[off + 23] = i;
+    f[off + 24] = 0xfd; f[off + 39] = 1;
+    off += 40;
+    if (ext) {
+        f[off] = IPPROTO_TCP;
+        off += 8;
+    }
+    addTcp(f, off, i);
+    return off + TCP_HLEN;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t iterations = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_ITERATIONS;
+
+    static BenchKind kinds[] = {
+        {"IPv4", {}, 0},
+        {"IPv4, VLAN", {}, 0},
+        {"IPv4, QinQ", {}, 0},
+        {"IPv6", {}, 0},
+        {"IPv6, VLAN", {}, 0},
+        {"IPv6, hop-by-hop", {}, 0},
+    };
+
+    for (int i = 0; i < BENCH_FRAMES; ++i) {
+        kinds[0].caplen = buildIPv4(kinds[0].frames[i], 0, i);
+        kinds[1].caplen = buildIPv4(kinds[1].frames[i], 1, i);
+        kinds[2].caplen = buildIPv4(kinds[2].frames[i], 2, i);
+        kinds[3].caplen = buildIPv6(kinds[3].frames[i], 0, false, i);
+        kinds[4].caplen = buildIPv6(kinds[4].frames[i], 1, false, i);
+        kinds[5].caplen = buildIPv6(kinds[5].frames[i], 0, true, i);
+    }
+
+    printf("%-18s %10s %12s\n", "frames", "ns/frame", "Mframes/s");
+    for (BenchKind &k: kinds) {
+        // the parsed fields are summed so the parsing isn't optimized away
+        uint64_t sum = 0;
+        uint64_t parsed = 0;
+        uint64_t start = nsNow();
+        for (uint64_t n = 0; n < iterations; ++n) {
+            PacketInfo pi;
+            if (parsePacket(k.frames[n % BENCH_FRAMES], k.caplen, &pi) == PARSE_OK) {
+                sum += pi.sd.m_srcport + pi.metrics + pi.len + pi.tos;
+                parsed++;
+            }
+        }
+        uint64_t ns = nsNow() - start;
+        bench_sink = sum;
+
+        if (parsed != iterations) {
+            fprintf(stderr, "%s frames not parsed\n", k.name);
+            return 1;
+        }
+        printf("%-18s %10.2f %12.1f\n", k.name, (double) ns / iterations, iterations * 1000.0 / ns);
+    }
+
+    return 0;
+}
@@ -0,0 +1,341 @@
+#include "bpf_backend.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/if_link.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#define QUEUE_ENTRIES (TA_BPF_CLASSES << QDELAY_BITS)
+#define FLOW_CHUNK 1024 // flows read in each batch
+
+BpfBackend::BpfBackend()
+{
+    m_obj = NULL;
+    m_ifindex = 0;
+    m_xdp = true;
+    m_tc_ingress = false;
+    m_tc_attached = false;
+    m_hook_created = false;
+    m_tc_handle = 0;
+    m_tc_priority = 0;
+    m_ncpus = 0;
+    m_flow_map = 0;
+}
+
+// the object file is installed next to the analyzer binary
+static std::string objectPath()
+{
+    char exe[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len <= 0)
+        return "analyzer.bpf.o";
+    exe[len] = '\0';
+
+    std::string path(exe);
+    return path.substr(0, path.rfind('/') + 1) + "analyzer.bpf.o";
+}
+
+bool BpfBackend::attach(const char *dev, const std::string &mode, bool ipclass)
+{
+    if (mode != "tc" && mode != "tc-ingress" && mode != "xdp") {
+        fprintf(stderr, "Unknown BPF attach mode %s, use tc, tc-ingress or xdp\n", mode.c_str());
+        return false;
+    }
+    m_xdp = mode == "xdp";
+    m_tc_ingress = mode == "tc-ingress";
+
+    m_ifindex = if_nametoindex(dev);
+    if (m_ifindex == 0) {
+        fprintf(stderr, "Unknown interface %s\n", dev);
+        return false;
+    }
+
+    m_ncpus = libbpf_num_possible_cpus();
+    if (m_ncpus <= 0) {
+        fprintf(stderr, "Can't get the number of cpus: %s\n", strerror(-m_ncpus));
+        return false;
+    }
+
+    std::string path = objectPath();
+    m_obj = bpf_object__open_file(path.c_str(), NULL);
+    if (m_obj == NULL || libbpf_get_error(m_obj)) {
+        fprintf(stderr, "Can't open %s\n", path.c_str());
+        m_obj = NULL;
+        return false;
+    }
+
+    if (bpf_object__load(m_obj) != 0) {
+        fprintf(stderr, "Can't load %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    m_config_fd = bpf_object__find_map_fd_by_name(m_obj, "config");
+    m_queue_fd = bpf_object__find_map_fd_by_name(m_obj, "queue");
+    m_totals_fd = bpf_object__find_map_fd_by_name(m_obj, "totals");
+    m_flows_fd = bpf_object__find_map_fd_by_name(m_obj, "flows");
+    m_flow_map_fds[0] = bpf_object__find_map_fd_by_name(m_obj, "flows0");
+    m_flow_map_fds[1] = bpf_object__find_map_fd_by_name(m_obj, "flows1");
+    m_counters_fd = bpf_object__find_map_fd_by_name(m_obj, "counters");
+    if (m_config_fd < 0 || m_queue_fd < 0 || m_totals_fd < 0 || m_flows_fd < 0 ||
+        m_flow_map_fds[0] < 0 || m_flow_map_fds[1] < 0 || m_counters_fd < 0) {
+        fprintf(stderr, "Maps missing in %s\n", path.c_str());
+        return false;
+    }
+
+    uint32_t key = TA_BPF_CONFIG_IPCLASS;
+    uint32_t value = ipclass;
+    bpf_map_update_elem(m_config_fd, &key, &value, BPF_ANY);
+
+    // per cpu values are padded to 8 bytes, which our structs already are
+    m_queue_last.resize(QUEUE_ENTRIES);
+    memset(m_queue_last.data(), 0, QUEUE_ENTRIES * sizeof(ta_bpf_queue));
+    memset(m_totals_last, 0, sizeof(m_totals_last));
+    m_queue_keys.resize(QUEUE_ENTRIES);
+    m_queue_values.resize(QUEUE_ENTRIES * m_ncpus);
+    m_totals_values.resize(2 * m_ncpus);
+    m_flow_keys.resize(FLOW_CHUNK);
+    m_flow_values.resize(FLOW_CHUNK * m_ncpus);
+    m_counter_values.resize(m_ncpus);
+
+    struct bpf_program *prog = bpf_object__find_program_by_name(m_obj, m_xdp ? "ta_xdp" : "ta_tc");
+    if (prog == NULL) {
+        fprintf(stderr, "Program missing in %s\n", path.c_str());
+        return false;
+    }
+    int prog_fd = bpf_program__fd(prog);
+
+    if (m_xdp) {
+        // veth and most drivers have native XDP, use generic XDP otherwise
+        if (bpf_xdp_attach(m_ifindex, prog_fd, XDP_FLAGS_DRV_MODE, NULL) != 0 &&
+            bpf_xdp_attach(m_ifindex, prog_fd, XDP_FLAGS_SKB_MODE, NULL) != 0) {
+            fprintf(stderr, "Can't attach XDP program to %s: %s\n", dev, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // the clsact qdisc is shared with any other tc programs on dev, so
+    // it is only created if missing, and our filter is added next to theirs
+    struct bpf_tc_hook hook;
+    tcHook(&hook);
+
+    int err = bpf_tc_hook_create(&hook);
+    if (err != 0 && err != -EEXIST) {
+        fprintf(stderr, "Can't create tc hook on %s: %s\n", dev, strerror(-err));
+        return false;
+    }
+    m_hook_created = err == 0;
+
+    struct bpf_tc_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.sz = sizeof(opts);
+    opts.prog_fd = prog_fd;
+    err = bpf_tc_attach(&hook, &opts);
+    if (err != 0) {
+        fprintf(stderr, "Can't attach tc program to %s: %s\n", dev, strerror(-err));
+        detach();
+        return false;
+    }
+    m_tc_attached = true;
+    m_tc_handle = opts.handle;
+    m_tc_priority = opts.priority;
+    return true;
+}
+
+void BpfBackend::tcHook(struct bpf_tc_hook *hook)
+{
+    memset(hook, 0, sizeof(*hook));
+    hook->sz = sizeof(*hook);
+    hook->ifindex = m_ifindex;
+    hook->attach_point = m_tc_ingress ? BPF_TC_INGRESS : BPF_TC_EGRESS;
+}
+
+void BpfBackend::detach()
+{
+    if (m_obj == NULL)
+        return;
+
+    if (m_xdp) {
+        bpf_xdp_detach(m_ifindex, XDP_FLAGS_DRV_MODE, NULL);
+        bpf_xdp_detach(m_ifindex, XDP_FLAGS_SKB_MODE, NULL);
+    } else {
+        struct bpf_tc_hook hook;
+        tcHook(&hook);
+
+        // only our own filter, found by the handle and priority it got
+        if (m_tc_attached) {
+            struct bpf_tc_opts opts;
+            memset(&opts, 0, sizeof(opts));
+            opts.sz = sizeof(opts);
+            opts.handle = m_tc_handle;
+            opts.priority = m_tc_priority;
+            int err = bpf_tc_detach(&hook, &opts);
+            if (err != 0)
+                fprintf(stderr, "Can't detach tc program: %s\n", strerror(-err));
+            m_tc_attached = false;
+        }
+
+        // both directions removes the clsact qdisc itself, which is
+        // left alone unless it was added by us
+        if (m_hook_created) {
+            hook.attach_point = (enum bpf_tc_attach_point) (BPF_TC_INGRESS | BPF_TC_EGRESS);
+            bpf_tc_hook_destroy(&hook);
+            m_hook_created = false;
+        }
+    }
+
+    bpf_object__close(m_obj);
+    m_obj = NULL;
+}
+
+uint64_t BpfBackend::collect(DataBlock *db, const QdelayLayout &layout)
+{
+    // swap the flow maps first, so the flows of the sample stop
+    // changing while they are read. The update returns when the
+    // programs still counting in the old map are done.
+    uint32_t key = 0;
+    m_flow_map ^= 1;
+    if (bpf_map_update_elem(m_flows_fd, &key, &m_flow_map_fds[m_flow_map], BPF_ANY) != 0)
+        fprintf(stderr, "Can't swap the flow maps: %s\n", strerror(errno));
+
+    uint64_t packets = 0;
+    uint32_t batch;
+    uint32_t count = QUEUE_ENTRIES;
+    if (bpf_map_lookup_batch(m_queue_fd, NULL, &batch, m_queue_keys.data(),
+                             m_queue_values.data(), &count, NULL) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Can't read the queue map: %s\n", strerror(errno));
+        count = 0;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t index = m_queue_keys[i];
+        if (index >= QUEUE_ENTRIES)
+            continue;
+
+        ta_bpf_queue sum = {0, 0};
+        for (int cpu = 0; cpu < m_ncpus; ++cpu) {
+            sum.packets += m_queue_values[i * m_ncpus + cpu].packets;
+            sum.drops += m_queue_values[i * m_ncpus + cpu].drops;
+        }
+
+        ta_bpf_queue &last = m_queue_last[index];
+        uint32_t p = sum.packets - last.packets;
+        uint32_t d = sum.drops - last.drops;
+        last = sum;
+        if (p == 0)
+            continue;
+
+        uint16_t bin = layout.bin[index & (QDELAY_CODES - 1)];
+        switch (index >> QDELAY_BITS) {
+        case 0:
+            db->tot_packets_nonecn += p;
+            db->qs.ecn00[bin] += p;
+            db->d_qs.ecn00[bin] += d;
+            break;
+        case 1:
+            db->tot_packets_ecn += p;
+            db->qs.ecn01[bin] += p;
+            db->d_qs.ecn01[bin] += d;
+            break;
+        case 2:
+            db->tot_packets_ecn += p;
+            db->qs.ecn10[bin] += p;
+            db->d_qs.ecn10[bin] += d;
+            break;
+        case 3:
+            db->tot_packets_ecn += p;
+            db->qs.ecn11[bin] += p;
+            db->d_qs.ecn11[bin] += d;
+            break;
+        }
+        db->packets_exact += p;
+        packets += p;
+    }
+
+    for (uint32_t ecn = 0; ecn < 2; ++ecn) {
+        if (bpf_map_lookup_elem(m_totals_fd, &ecn, m_totals_values.data()) != 0)
+            continue;
+
+        ta_bpf_totals sum = {0, 0, 0};
+        for (int cpu = 0; cpu < m_ncpus; ++cpu) {
+            sum.rate += m_totals_values[cpu].rate;
+            sum.drops += m_totals_values[cpu].drops;
+            sum.marks += m_totals_values[cpu].marks;
+        }
+
+        ClassTotals &tot = ecn ? db->ecn_tot : db->nonecn_tot;
+        tot.rate += sum.rate - m_totals_last[ecn].rate;
+        tot.drops += sum.drops - m_totals_last[ecn].drops;
+        tot.marks += sum.marks - m_totals_last[ecn].marks;
+        m_totals_last[ecn] = sum;
+    }
+
+    collectFlows(db);
+    return packets;
+}
+
+// Moves the flows of the previous sample from its flow map, which the
+// program no longer uses, into the flow tables. The map is read and
+// emptied in chunks.
+void BpfBackend::collectFlows(DataBlock *db)
+{
+    int map_fd = m_flow_map_fds[m_flow_map ^ 1];
+    uint32_t in_batch, out_batch;
+    bool first = true;
+    bool done = false;
+
+    while (!done) {
+        uint32_t count = FLOW_CHUNK;
+        if (bpf_map_lookup_and_delete_batch(map_fd, first ? NULL : &in_batch, &out_batch,
+                                            m_flow_keys.data(), m_flow_values.data(), &count, NULL) != 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "Can't read the flows map: %s\n", strerror(errno));
+                break;
+            }
+            done = true;
+        }
+        first = false;
+        in_batch = out_batch;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            const ta_bpf_flow_key &k = m_flow_keys[i];
+
+            FlowData sum;
+            for (int cpu = 0; cpu < m_ncpus; ++cpu) {
+                const ta_bpf_flow &v = m_flow_values[i * m_ncpus + cpu];
+                sum.rate += v.rate;
+                sum.packets += v.packets;
+                sum.drops += v.drops;
+                sum.marks += v.marks;
+            }
+
+            SrcDst sd(k.proto, IPAddr((const uint8_t *) k.srcip), k.srcport,
+                      IPAddr((const uint8_t *) k.dstip), k.dstport);
+            FlowTable<SrcDst,FlowData> *fmap = k.ecn ? &db->fm.ecn_rate : &db->fm.nonecn_rate;
+
+            bool inserted;
+            FlowData &fd = fmap->insert(sd, sd.hash(), sum, &inserted);
+            if (!inserted) {
+                fd.rate += sum.rate;
+                fd.packets += sum.packets;
+                fd.drops += sum.drops;
+                fd.marks += sum.marks;
+            }
+        }
+    }
+}
+
+uint64_t BpfBackend::counter(uint32_t index)
+{
+    uint64_t sum = 0;
+    if (m_obj == NULL || bpf_map_lookup_elem(m_counters_fd, &index, m_counter_values.data()) != 0)
+        return 0;
+    for (int cpu = 0; cpu < m_ncpus; ++cpu)
+        sum += m_counter_values[cpu];
+    return sum;
+}
@@ -0,0 +1,73 @@
+#ifndef BPF_BACKEND_H
+#define BPF_BACKEND_H
+
+#include <linux/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "analyzer.h"
+#include "bpf_maps.h"
+
+struct bpf_object;
+struct bpf_tc_hook;
+
+// Analyzer backend using in-kernel aggregation instead of libpcap
+//
+// The program in analyzer.bpf.c is attached to the monitored interface
+// and counts the packets in maps, which are read into the capture
+// DataBlock at each sample boundary by collect(). Only built with
+// "make analyzer_bpf" (TA_BPF), as it needs libbpf.
+struct BpfBackend {
+public:
+    BpfBackend();
+
+    // loads analyzer.bpf.o from the folder of the analyzer binary and
+    // attaches it to dev, mode is "tc" (clsact egress), "tc-ingress" or
+    // "xdp" (ingress)
+    bool attach(const char *dev, const std::string &mode, bool ipclass);
+    void detach();
+
+    // adds everything counted since the last call to db, and returns
+    // the number of packets
+    uint64_t collect(DataBlock *db, const QdelayLayout &layout);
+
+    // totals since attach of the TA_BPF_COUNTER_* counters
+    uint64_t counter(uint32_t index);
+
+private:
+    struct bpf_object *m_obj;
+    int m_ifindex;
+    bool m_xdp;
+    bool m_tc_ingress;
+    bool m_tc_attached;
+    bool m_hook_created; // we added the clsact qdisc
+    uint32_t m_tc_handle;
+    uint32_t m_tc_priority;
+    int m_ncpus;
+    uint32_t m_flow_map; // index of the flow map the program counts in
+
+    int m_config_fd;
+    int m_queue_fd;
+    int m_totals_fd;
+    int m_flows_fd;       // map of maps, holds the current flow map
+    int m_flow_map_fds[2];
+    int m_counters_fd;
+
+    // totals at the last read, the counters only grow
+    std::vector<ta_bpf_queue> m_queue_last;
+    ta_bpf_totals m_totals_last[2];
+
+    // buffers for the batch reads, allocated once
+    std::vector<uint32_t> m_queue_keys;
+    std::vector<ta_bpf_queue> m_queue_values;  // one per cpu and key
+    std::vector<ta_bpf_totals> m_totals_values;
+    std::vector<ta_bpf_flow_key> m_flow_keys;
+    std::vector<ta_bpf_flow> m_flow_values;
+    std::vector<uint64_t> m_counter_values;
+
+    void tcHook(struct bpf_tc_hook *hook);
+    void collectFlows(DataBlock *db);
+};
+
+#endif // BPF_BACKEND_H
@@ -0,0 +1,62 @@
+#ifndef BPF_MAPS_H
+#define BPF_MAPS_H
+
+/* Maps shared between the in-kernel aggregation program (analyzer.bpf.c)
+ * and the BPF backend of the analyzer (bpf_backend.cpp), see
+ * "make analyzer_bpf".
+ *
+ * The queue and totals maps are per-CPU counters that only grow, the
+ * analyzer reads them at each sample boundary and uses the difference
+ * from the last read, so nothing has to be reset under the program.
+ * The flows are counted in one of two flow maps, the one in the flows
+ * map of maps. At the sample boundary the analyzer puts the other one
+ * there, which returns only after every program that could still use
+ * the old one has finished (map of maps updates wait for an RCU grace
+ * period), and then moves the flows out of the old one.
+ */
+
+#define TA_BPF_CLASSES 4    /* ECN codepoints, or address bits with ipclass */
+#define TA_BPF_FLOWS 65536  /* flows in a sample, in each flow map */
+
+/* indexes in the config map */
+#define TA_BPF_CONFIG_IPCLASS 0
+#define TA_BPF_CONFIG_SIZE 1
+
+/* indexes in the counters map */
+#define TA_BPF_COUNTER_NONIP 0
+#define TA_BPF_COUNTER_MALFORMED 1
+#define TA_BPF_COUNTER_FLOWS_FULL 2 /* packets of flows that didn't fit */
+#define TA_BPF_COUNTER_SIZE 3
+
+/* queue map, indexed by class * QDELAY_CODES + encoded qdelay */
+struct ta_bpf_queue {
+	__u64 packets;
+	__u64 drops;
+};
+
+/* totals map, indexed by ecn (0 or 1) like ClassTotals */
+struct ta_bpf_totals {
+	__u64 rate; /* bits */
+	__u64 drops;
+	__u64 marks;
+};
+
+/* addresses are IPv4-mapped IPv6 in network byte order, as IPAddr */
+struct ta_bpf_flow_key {
+	__u32 srcip[4];
+	__u32 dstip[4];
+	__u16 srcport;
+	__u16 dstport;
+	__u8 proto;
+	__u8 ecn;
+	__u8 pad[2];
+};
+
+struct ta_bpf_flow {
+	__u64 rate; /* bits */
+	__u64 packets;
+	__u32 drops;
+	__u32 marks;
+};
+
+#endif /* BPF_MAPS_H */
@@ -0,0 +1,130 @@
+#ifndef FLOWTABLE_H
+#define FLOWTABLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define FLOWTABLE_MIN_CAPACITY 1024
+
+// Hash table from flow to per flow data, used instead of std::map on the
+// capture path.
+//
+// Entries are stored densely in insertion order with an open addressing
+// index (linear probing) on top. init() keeps the memory, so once the
+// table has grown to the number of flows in a sample it does no more
+// allocations. It only grows (doubling) when full. Tables kept across
+// samples drop their idle flows with removeIf().
+template <typename Key, typename Value>
+struct FlowTable {
+public:
+    struct Entry {
+        Key key;
+        Value value;
+        uint64_t hash;
+    };
+
+    FlowTable() : m_capacity(FLOWTABLE_MIN_CAPACITY), m_n(0) {
+        m_entries = new Entry[m_capacity];
+        m_index_size = 2 * m_capacity;
+        m_index = new int32_t[m_index_size];
+        memset(m_index, -1, m_index_size * sizeof(int32_t));
+    }
+
+    void init() {
+        if (m_n > 0)
+            memset(m_index, -1, m_index_size * sizeof(int32_t));
+        m_n = 0;
+    }
+
+    // the value for the key, inserted as a copy of value if missing
+    Value &insert(const Key &key, uint64_t hash, const Value &value, bool *inserted) {
+        uint32_t slot = slotOf(key, hash);
+        if (m_index[slot] != -1) {
+            *inserted = false;
+            return m_entries[m_index[slot]].value;
+        }
+
+        if (m_n == m_capacity) {
+            grow();
+            slot = slotOf(key, hash);
+        }
+
+        Entry &e = m_entries[m_n];
+        e.key = key;
+        e.value = value;
+        e.hash = hash;
+        m_index[slot] = m_n++;
+        *inserted = true;
+        return e.value;
+    }
+
+    // the value for the key, NULL if missing
+    Value *find(const Key &key, uint64_t hash) {
+        int32_t i = m_index[slotOf(key, hash)];
+        return i == -1 ? NULL : &m_entries[i].value;
+    }
+
+    uint32_t size() const { return m_n; }
+
+    // removes the entries whose value remove() is true for, keeping the
+    // memory and the order of the others, and returns how many
+    template <typename F>
+    uint32_t removeIf(F remove) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < m_n; ++i) {
+            if (remove(m_entries[i].value))
+                continue;
+            if (n != i)
+                m_entries[n] = m_entries[i];
+            n++;
+        }
+
+        uint32_t removed = m_n - n;
+        if (removed == 0)
+            return 0;
+        m_n = n;
+        memset(m_index, -1, m_index_size * sizeof(int32_t));
+        for (uint32_t i = 0; i < m_n; ++i)
+            m_index[slotOf(m_entries[i].key, m_entries[i].hash)] = i;
+        return removed;
+    }
+
+    // the entries in insertion order
+    Entry *begin() { return m_entries; }
+    Entry *end() { return m_entries + m_n; }
+    const Entry *begin() const { return m_entries; }
+    const Entry *end() const { return m_entries + m_n; }
+
+private:
+    uint32_t m_capacity;
+    uint32_t m_index_size; // twice the capacity, a power of two
+    uint32_t m_n;
+    Entry *m_entries;
+    int32_t *m_index; // position in m_entries, -1 for unused slots
+
+    // slot holding the key, or the empty slot where it should go
+    uint32_t slotOf(const Key &key, uint64_t hash) const {
+        uint32_t slot = hash & (m_index_size - 1);
+        while (m_index[slot] != -1 && !(m_entries[m_index[slot]].key == key))
+            slot = (slot + 1) & (m_index_size - 1);
+        return slot;
+    }
+
+    void grow() {
+        Entry *entries = new Entry[2 * m_capacity];
+        for (uint32_t i = 0; i < m_n; ++i)
+            entries[i] = m_entries[i];
+        delete[] m_entries;
+        delete[] m_index;
+
+        m_entries = entries;
+        m_capacity *= 2;
+        m_index_size = 2 * m_capacity;
+        m_index = new int32_t[m_index_size];
+        memset(m_index, -1, m_index_size * sizeof(int32_t));
+        for (uint32_t i = 0; i < m_n; ++i)
+            m_index[slotOf(m_entries[i].key, m_entries[i].hash)] = i;
+    }
+};
+
+#endif // FLOWTABLE_H
@@ -0,0 +1,30 @@
+// libFuzzer target for the packet parsing, see "make fuzz_parse". The
+// input is the captured frame, and the parser must not read outside it
+// whatever it holds, which ASan checks as the input has the exact size.
+//
+//   ./fuzz_parse -max_len=256 corpus/
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "packet.h"
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    PacketInfo pi;
+    if (parsePacket(data, size, &pi) != PARSE_OK)
+        return 0;
+
+    // the ports, when there are any, were in the captured data
+    if (hasPorts(pi.sd.m_proto) && pi.l4off != 0 && pi.l4off + PORTS_LEN > size)
+        abort();
+
+    uint32_t tsval, tsecr;
+    parseTcpTimestamps(data, size, pi, &tsval, &tsecr);
+
+    uint32_t seq, seqlen;
+    bool syn;
+    parseTcpSeq(data, size, pi, &seq, &seqlen, &syn);
+
+    return 0;
+}
@@ -1,15 +1,77 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "analyzer.h"
+#include "sojourn.h"
+#include "trace.h"
+#ifdef TA_BPF
+#include "bpf_backend.h"
+#endif
 
 void usage(int argc, char* argv[])
 {
-    printf("Usage: %s <dev> <pcap filter exp> <output folder> <sample interval (ms)> <ipclass> [nrsamples]\n", argv[0]);
+    printf("Usage: %s [options] <dev> <pcap filter exp> <output folder> <sample interval (ms)> <ipclass> [nrsamples]\n", argv[0]);
     printf("pcap filter: what to capture. ex.: \"ip and src net 10.187.255.0/24\"\n");
     printf("If nrsamples is not specified, the samples will be recorded until interrupted\n");
+    printf("Options:\n");
+    printf("  -p <bits>  queue delay histogram precision in mantissa bits (default all encoded bits)\n");
+    printf("  -r <us>    queue delay histogram range, larger delays go in the last bin (default no limit)\n");
+    printf("  -f <n>     keep queue delay histograms for up to n flows per sample, preferring\n");
+    printf("             the flows with most traffic (default 0, disabled)\n");
+    printf("  -k <n>     approximate per flow accounting, only reporting the n flows with\n");
+    printf("             highest rate in each queue (default 0, exact accounting of all flows)\n");
+    printf("  -s <bytes> capture length of each frame (default %d), 96 is enough for\n", BUFSIZ);
+    printf("             IPv6 with VLAN tags and a few extension headers\n");
+    printf("  -v         print the rate of every flow for each sample\n");
+    printf("  -R <n,..>  also write the queue and rate files summed over n samples, in\n");
+    printf("             the folder rollup_<n * sample interval>ms, for each n given\n");
+    printf("  -e <us>    only write samples with queue delay above this, and the %d\n", EVENT_HOLD_SAMPLES);
+    printf("             samples before and after them (use with -R to keep the coarser data)\n");
+    printf("  -D <n>     only write samples with at least n drops, and the %d samples\n", EVENT_HOLD_SAMPLES);
+    printf("             before and after them. With -e, samples passing either are written\n");
+    printf("  -C <cpu>   pin the capture thread to this cpu\n");
+    printf("  -P <cpu>   pin the reporting thread to this cpu\n");
+    printf("  -F         run the reporting thread with real time priority (SCHED_FIFO)\n");
+    printf("  -c <file>  read exact drop totals from the counter file exported by the\n");
+    printf("             scheduler at each sample, instead of using the drops in packets\n");
+    printf("  -t <filter> estimate the RTT of TCP flows from their timestamps, capturing\n");
+    printf("             the ACKs on dev with this pcap filter (the reverse of the main\n");
+    printf("             filter), written to rtt_ecn, rtt_nonecn and flows_rtt_*\n");
+    printf("  -T <file>  sum up the traffic of each tag, by the ports in the traffic= lines\n");
+    printf("             of file (e.g. the details file of the test), which is read again\n");
+    printf("             when it changes. Written to rate_tagged, drops_tagged and\n");
+    printf("             marks_tagged with a column for each tag in the tags file\n");
+    printf("  -L         detect the losses of TCP flows before the capture point from\n");
+    printf("             their sequence numbers, written to loss_ecn, loss_nonecn and\n");
+    printf("             flows_loss_*, with the retransmissions in flows_retrans_*\n");
+    printf("  -Q <spec>  also count the packets in the queues of a scheduler with more\n");
+    printf("             classes, by DSCP or source/destination port, e.g. dscp:46,10+12\n");
+    printf("             or port:5000-5099,5100-5199 (a class is values joined by +),\n");
+    printf("             with the rest in \"%s\". Each class is written to the folder\n", CLASS_DEFAULT);
+    printf("             class_<name>, as the ECN queues are\n");
+    printf("  -S <n>     count only 1 in n (at most %d) of the packets without drops\n", SAMPLE_MAX);
+    printf("             or CE marks, n times each, so drops and marks stay exact while\n");
+    printf("             rates and packet counts are unbiased estimates. Written to sampling\n");
+    printf("  -B <us>[,<window>] write the queue delay spikes above us to events, each\n");
+    printf("             lasting until no packet was above it for window us (default 1000)\n");
+    printf("  -w <dir>   also write a record of every packet to a trace in dir, from\n");
+    printf("             which ta_trace writes the queue, rate and flow files again\n");
+    printf("  -W <MB>[,<n>] size of each trace file (default %d MB), and how many of\n", TRACE_FILE_MB);
+    printf("             the last files to keep (default all, at least 2)\n");
+    printf("  -I <dev>[,<ms>] for AQMs that don't write the queue delay into the\n");
+    printf("             packets: capture before the AQM on dev too, with dev given last\n");
+    printf("             after it, and use the time between the two copies of each packet\n");
+    printf("             as its queue delay. Packets not seen after it within ms (default\n");
+    printf("             %d) are counted as drops. Turn off GRO on both devices\n", SOJOURN_TIMEOUT);
+    printf("  -X <mode>  count the packets in the kernel instead of capturing them, with\n");
+    printf("             a BPF program attached to dev: tc (egress, where the AQM sends\n");
+    printf("             them), tc-ingress or xdp (ingress). The pcap filter is not used,\n");
+    printf("             so dev should only carry the test traffic.\n");
+    printf("             Needs the analyzer_bpf build, and can't be used with -f and -k\n");
     exit(1);
 }
 
@@ -19,11 +81,154 @@ int main(int argc, char **argv)
     uint32_t sinterval;
     bool ipclass = false;
     uint32_t nrs = 0;
+    Options opts;
+    int opt;
 
+    while ((opt = getopt(argc, argv, "+p:r:f:k:s:c:vLR:e:D:C:P:Ft:T:B:S:Q:I:w:W:X:")) != -1) {
+        switch (opt) {
+        case 'p':
+            opts.qdelay_precision = atoi(optarg);
+            break;
+        case 'r':
+            opts.qdelay_range = atoi(optarg);
+            break;
+        case 'f':
+            opts.flow_hists = atoi(optarg);
+            break;
+        case 'k':
+            opts.topk = atoi(optarg);
+            break;
+        case 's':
+            opts.snaplen = atoi(optarg);
+            break;
+        case 'R':
+            for (char *p = strtok(optarg, ","); p != NULL; p = strtok(NULL, ",")) {
+                int n = atoi(p);
+                if (n < 2) {
+                    fprintf(stderr, "Rollups need at least 2 samples\n");
+                    exit(1);
+                }
+                opts.rollups.push_back(n);
+            }
+            break;
+        case 'e':
+            opts.event_qdelay = atoi(optarg);
+            break;
+        case 'D':
+            opts.event_drops = atoi(optarg);
+            break;
+        case 'C':
+            opts.capture_cpu = atoi(optarg);
+            break;
+        case 'P':
+            opts.report_cpu = atoi(optarg);
+            break;
+        case 'F':
+            opts.realtime = true;
+            break;
+        case 'v':
+            opts.verbose = true;
+            break;
+        case 'c':
+            opts.drop_counters = optarg;
+            break;
+        case 't':
+            opts.ack_filter = optarg;
+            break;
+        case 'T':
+            opts.tag_rules = optarg;
+            break;
+        case 'B':
+            optarg = strtok(optarg, ",");
+            if (optarg == NULL)
+                usage(argc, argv);
+            opts.spike_qdelay = atoi(optarg);
+            if (char *p = strtok(NULL, ","))
+                opts.spike_window = atoi(p);
+            break;
+        case 'S':
+            opts.sample_n = atoi(optarg);
+            if (opts.sample_n < 1 || opts.sample_n > SAMPLE_MAX) {
+                fprintf(stderr, "Sampling is 1 in 1 to %d packets\n", SAMPLE_MAX);
+                exit(1);
+            }
+            break;
+        case 'L':
+            opts.tcp_loss = true;
+            break;
+        case 'Q':
+            opts.queue_classes = optarg;
+            break;
+        case 'I':
+            optarg = strtok(optarg, ",");
+            if (optarg == NULL)
+                usage(argc, argv);
+            opts.ingress_dev = optarg;
+            if (char *p = strtok(NULL, ","))
+                opts.sojourn_timeout = atoi(p);
+            break;
+        case 'w':
+            opts.trace_folder = optarg;
+            break;
+        case 'W':
+            optarg = strtok(optarg, ",");
+            if (optarg == NULL)
+                usage(argc, argv);
+            opts.trace_mb = atoi(optarg);
+            if (char *p = strtok(NULL, ","))
+                opts.trace_keep = atoi(p);
+            if (opts.trace_mb == 0 || opts.trace_keep == 1) {
+                fprintf(stderr, "Trace files need a size, and at least 2 are kept\n");
+                exit(1);
+            }
+            break;
+        case 'X':
+#ifndef TA_BPF
+            fprintf(stderr, "Built without in-kernel aggregation, see \"make analyzer_bpf\"\n");
+            exit(1);
+#endif
+            opts.bpf_mode = optarg;
+            break;
+        default:
+            usage(argc, argv);
+        }
+    }
 
-    if (argc < 5)
+    if (opts.topk > 0 && opts.flow_hists > 0) {
+        fprintf(stderr, "Per flow queue delay histograms need exact per flow accounting\n");
+        exit(1);
+    }
+
+    if (!opts.bpf_mode.empty() && (opts.topk > 0 || opts.flow_hists > 0 || !opts.ack_filter.empty() ||
+                                   !opts.tag_rules.empty() || !opts.trace_folder.empty() || opts.spike_qdelay != 0 ||
+                                   opts.sample_n > 1 || !opts.queue_classes.empty() || !opts.ingress_dev.empty() ||
+                                   opts.tcp_loss)) {
+        fprintf(stderr, "In-kernel aggregation only does exact per flow totals, without -f, -k, -t, -T, -B, -S, -Q, -I, -L and -w\n");
+        exit(1);
+    }
+
+    if (opts.sample_n > 1 && !opts.trace_folder.empty()) {
+        fprintf(stderr, "The trace has no sampling weights, use either -S or -w\n");
+        exit(1);
+    }
+
+    if (opts.sample_n > 1 && opts.tcp_loss) {
+        fprintf(stderr, "Sampling skips packets, which would be taken as losses, use either -S or -L\n");
+        exit(1);
+    }
+
+    if (opts.sample_n > 1 && !opts.ingress_dev.empty()) {
+        fprintf(stderr, "Both copies of a packet are needed for its sojourn time, use either -S or -I\n");
+        exit(1);
+    }
+
+    // the positional arguments follow the options
+    if (argc - optind < 4)
         usage(argc, argv);
 
+    argc -= optind - 1;
+    argv += optind - 1;
+
     dev = argv[1];
 
     std::string pcapfilter = argv[2];
@@ -40,9 +245,32 @@ int main(int argc, char **argv)
 
     mkdir(folder.c_str(), 0777);
 
-    ThreadParam *param = new ThreadParam(sinterval, folder, ipclass, nrs); 
+    ThreadParam *param = new ThreadParam(sinterval, folder, ipclass, nrs, opts); 
+
+#ifdef TA_BPF
+    if (!opts.bpf_mode.empty()) {
+        param->bpf = new BpfBackend();
+        if (!param->bpf->attach(dev, opts.bpf_mode, ipclass))
+            exit(1);
+    } else
+#endif
+    if (setup_pcap(param, dev, pcapfilter, opts.snaplen) != 0)
+        exit(1);
+
+    if (!opts.ack_filter.empty()) {
+        std::cout << "ACK filter: " << opts.ack_filter << std::endl;
+        param->m_descr_ack = open_pcap(dev, opts.ack_filter, opts.snaplen);
+        if (param->m_descr_ack == NULL)
+            exit(1);
+    }
+
+    if (!opts.ingress_dev.empty()) {
+        std::cout << "Ingress: " << opts.ingress_dev << std::endl;
+        param->m_descr_ingress = open_pcap(opts.ingress_dev.c_str(), pcapfilter, opts.snaplen);
+        if (param->m_descr_ingress == NULL)
+            exit(1);
+    }
 
-    setup_pcap(param, dev, pcapfilter);
     start_analysis(param);
 
     return 0;
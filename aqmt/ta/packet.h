@@ -0,0 +1,245 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <netinet/if_ether.h> // includes net/ethernet.h
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h> // TCPOPT_*
+
+#include "analyzer.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define VLAN_HLEN 4
+#define MAX_VLAN_TAGS 2
+#define MAX_IPV6_EXT_HDRS 4
+#define PORTS_LEN 4 // source and destination port in TCP and UDP headers
+#define TCP_HLEN 20
+
+// smallest frame the IPv4 fast path can handle with a single check
+#define MIN_IPV4_FRAME (ETH_HLEN + sizeof(struct iphdr) + PORTS_LEN)
+
+enum ParseResult {
+    PARSE_OK,
+    PARSE_NOT_IP,    // frame carries something else than IPv4/IPv6
+    PARSE_MALFORMED, // truncated or invalid headers
+};
+
+// The fields we need from a captured frame
+struct PacketInfo {
+public:
+    SrcDst sd;
+    uint16_t metrics;  // qdelay and drops as stored by testbed_add_metrics
+    uint8_t tos;       // TOS or traffic class, ECN in the two lowest bits
+    uint32_t addrbits; // lowest 32 bits of the source address (host order)
+    uint32_t len;      // bytes on the link, including the ethernet header
+    uint32_t l4off;    // offset of the transport header in the frame
+};
+
+static inline bool hasPorts(uint8_t proto)
+{
+    return proto == IPPROTO_TCP || proto == IPPROTO_UDP;
+}
+
+// l4 must have PORTS_LEN bytes available for TCP and UDP, which both
+// start with the source and destination port
+static inline void parsePorts(const u_char *l4, PacketInfo *pi)
+{
+    if (hasPorts(pi->sd.m_proto)) {
+        pi->sd.m_srcport = (l4[0] << 8) | l4[1];
+        pi->sd.m_dstport = (l4[2] << 8) | l4[3];
+    } else {
+        pi->sd.m_srcport = 0;
+        pi->sd.m_dstport = 0;
+    }
+}
+
+// l2len is the size of the link header in front of the IP header, and
+// caplen the captured length of the full frame
+static inline ParseResult parseIPv4(const u_char *l3, uint32_t l2len, uint32_t caplen, PacketInfo *pi)
+{
+    const struct iphdr *iph = (const struct iphdr *) l3;
+    uint32_t hlen = iph->ihl*4;
+
+    // everything we read must be inside the captured data, checked as
+    // one condition, the minimum header size is already checked
+    uint32_t need = l2len + hlen + (hasPorts(iph->protocol) ? PORTS_LEN : 0);
+    if (unlikely((need > caplen) | (iph->version != 4) | (hlen < sizeof(struct iphdr)) |
+                 (ntohs(iph->tot_len) < hlen)))
+        return PARSE_MALFORMED;
+
+    pi->sd.m_proto = iph->protocol;
+    pi->sd.m_srcip = IPAddr(iph->saddr);
+    pi->sd.m_dstip = IPAddr(iph->daddr);
+    pi->metrics = ntohs(iph->id);
+    pi->tos = iph->tos;
+    pi->addrbits = ntohl(iph->saddr);
+    pi->len = ntohs(iph->tot_len) + l2len;
+    pi->l4off = l2len + hlen;
+
+    parsePorts(l3 + hlen, pi);
+    return PARSE_OK;
+}
+
+// For IPv6 the metrics are stored in the lowest 16 bits of the flow
+// label, as there is no id field (see testbed_add_metrics)
+static inline ParseResult parseIPv6(const u_char *l3, uint32_t l2len, uint32_t caplen, PacketInfo *pi)
+{
+    const struct ip6_hdr *ip6h = (const struct ip6_hdr *) l3;
+
+    if (caplen < l2len + sizeof(struct ip6_hdr) || (l3[0] >> 4) != 6)
+        return PARSE_MALFORMED;
+
+    uint32_t flow = ntohl(ip6h->ip6_flow);
+
+    pi->sd.m_srcip = IPAddr(ip6h->ip6_src.s6_addr);
+    pi->sd.m_dstip = IPAddr(ip6h->ip6_dst.s6_addr);
+    pi->metrics = flow & 0xffff;
+    pi->tos = (flow >> 20) & 0xff;
+    pi->addrbits = ntohl(pi->sd.m_srcip.w[3]);
+    pi->len = ntohs(ip6h->ip6_plen) + sizeof(struct ip6_hdr) + l2len;
+
+    // skip extension headers to find the transport header
+    uint8_t nxt = ip6h->ip6_nxt;
+    uint32_t off = l2len + sizeof(struct ip6_hdr); // offset in frame
+    for (int i = 0; i < MAX_IPV6_EXT_HDRS; ++i) {
+        if (nxt == IPPROTO_HOPOPTS || nxt == IPPROTO_ROUTING || nxt == IPPROTO_DSTOPTS) {
+            if (caplen < off + 2)
+                return PARSE_MALFORMED;
+            const u_char *ext = l3 - l2len + off;
+            nxt = ext[0];
+            off += (ext[1] + 1) * 8;
+        } else if (nxt == IPPROTO_FRAGMENT) {
+            if (caplen < off + sizeof(struct ip6_frag))
+                return PARSE_MALFORMED;
+            const struct ip6_frag *frag = (const struct ip6_frag *) (l3 - l2len + off);
+            nxt = frag->ip6f_nxt;
+            off += sizeof(struct ip6_frag);
+            if ((frag->ip6f_offlg & IP6F_OFF_MASK) != 0) {
+                // only the first fragment has the transport header
+                pi->sd.m_proto = nxt;
+                pi->sd.m_srcport = 0;
+                pi->sd.m_dstport = 0;
+                pi->l4off = 0;
+                return PARSE_OK;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (hasPorts(nxt) && caplen < off + PORTS_LEN)
+        return PARSE_MALFORMED;
+
+    pi->sd.m_proto = nxt;
+    pi->l4off = off;
+    parsePorts(l3 - l2len + off, pi);
+    return PARSE_OK;
+}
+
+// Anything but untagged IPv4 with a full header. Kept out of line so
+// the IPv4 path in parsePacket stays small.
+static ParseResult __attribute__((noinline)) parsePacketSlow(const u_char *buffer, uint32_t caplen, PacketInfo *pi)
+{
+    if (caplen < ETH_HLEN)
+        return PARSE_MALFORMED;
+
+    uint16_t ethertype = (buffer[12] << 8) | buffer[13];
+    uint32_t l2len = ETH_HLEN;
+
+    for (int i = 0; i < MAX_VLAN_TAGS; ++i) {
+        if (ethertype != ETHERTYPE_VLAN && ethertype != 0x88a8) // 802.1Q and 802.1ad
+            break;
+        if (caplen < l2len + VLAN_HLEN)
+            return PARSE_MALFORMED;
+        ethertype = (buffer[l2len + 2] << 8) | buffer[l2len + 3];
+        l2len += VLAN_HLEN;
+    }
+
+    if (ethertype == ETHERTYPE_IP) {
+        if (caplen < l2len + sizeof(struct iphdr))
+            return PARSE_MALFORMED;
+        return parseIPv4(buffer + l2len, l2len, caplen, pi);
+    }
+    if (ethertype == ETHERTYPE_IPV6)
+        return parseIPv6(buffer + l2len, l2len, caplen, pi);
+
+    return PARSE_NOT_IP;
+}
+
+// Parses a captured frame of caplen bytes. Nothing outside the captured
+// data is read, so this is safe for any input and with a small snaplen.
+static inline ParseResult parsePacket(const u_char *buffer, uint32_t caplen, PacketInfo *pi)
+{
+    const struct ether_header *ethh = (const struct ether_header *) buffer;
+
+    if (likely(caplen >= MIN_IPV4_FRAME && ethh->ether_type == htons(ETHERTYPE_IP)))
+        return parseIPv4(buffer + ETH_HLEN, ETH_HLEN, caplen, pi);
+
+    return parsePacketSlow(buffer, caplen, pi);
+}
+
+// Finds the TCP timestamp option (RFC 7323) of a parsed TCP packet, false
+// if there is none or it is not in the captured data. Most stacks put it
+// first after two NOPs, which is checked before walking the options.
+static inline bool parseTcpTimestamps(const u_char *buffer, uint32_t caplen, const PacketInfo &pi,
+                                      uint32_t *tsval, uint32_t *tsecr)
+{
+    if (pi.sd.m_proto != IPPROTO_TCP || pi.l4off == 0 || caplen < pi.l4off + TCP_HLEN)
+        return false;
+
+    const u_char *tcph = buffer + pi.l4off;
+    uint32_t end = pi.l4off + (tcph[12] >> 4) * 4; // data offset
+    if (end > caplen)
+        end = caplen;
+
+    uint32_t off = pi.l4off + TCP_HLEN;
+    if (off + 2 + TCPOLEN_TIMESTAMP <= end &&
+        buffer[off] == TCPOPT_NOP && buffer[off + 1] == TCPOPT_NOP &&
+        buffer[off + 2] == TCPOPT_TIMESTAMP && buffer[off + 3] == TCPOLEN_TIMESTAMP) {
+        off += 2;
+    } else {
+        while (off + 1 < end && buffer[off] != TCPOPT_TIMESTAMP) {
+            if (buffer[off] == TCPOPT_EOL)
+                return false;
+            if (buffer[off] == TCPOPT_NOP)
+                off++;
+            else if (buffer[off + 1] < 2)
+                return false;
+            else
+                off += buffer[off + 1];
+        }
+        if (off + TCPOLEN_TIMESTAMP > end || buffer[off + 1] != TCPOLEN_TIMESTAMP)
+            return false;
+    }
+
+    const u_char *o = buffer + off + 2;
+    *tsval = ((uint32_t) o[0] << 24) | (o[1] << 16) | (o[2] << 8) | o[3];
+    *tsecr = ((uint32_t) o[4] << 24) | (o[5] << 16) | (o[6] << 8) | o[7];
+    return true;
+}
+
+// Sequence number and length in sequence numbers (the data, SYN and
+// FIN) of a parsed TCP packet, false if it is not TCP, takes no
+// sequence numbers or the header is not in the captured data
+static inline bool parseTcpSeq(const u_char *buffer, uint32_t caplen, const PacketInfo &pi,
+                               uint32_t *seq, uint32_t *len, bool *syn)
+{
+    if (pi.sd.m_proto != IPPROTO_TCP || pi.l4off == 0 || caplen < pi.l4off + TCP_HLEN)
+        return false;
+
+    const u_char *tcph = buffer + pi.l4off;
+    uint32_t hlen = (tcph[12] >> 4) * 4; // data offset
+    uint32_t l4len = pi.len - pi.l4off;
+    if (l4len < hlen)
+        return false;
+
+    uint8_t flags = tcph[13];
+    *seq = ((uint32_t) tcph[4] << 24) | (tcph[5] << 16) | (tcph[6] << 8) | tcph[7];
+    *len = l4len - hlen + ((flags & TH_SYN) != 0) + ((flags & TH_FIN) != 0);
+    *syn = (flags & TH_SYN) != 0;
+    return *len != 0;
+}
+
+#endif // PACKET_H
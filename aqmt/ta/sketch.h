@@ -0,0 +1,202 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MIN_WIDTH 1024
+
+// Approximate per flow accounting for runs with many flows.
+//
+// A count-min sketch holds rate (bits), drops and marks for every flow,
+// and a min-heap keeps the K flows with the highest estimated rate.
+// Flows in the heap are counted exactly from the time they enter it, and
+// start out with the sketch estimate, which overestimates by at most
+// e/width of the total rate with probability 1 - e^-SKETCH_DEPTH.
+//
+// Each packet costs SKETCH_DEPTH counter updates, a lookup in a small
+// open addressing index and possibly a heap sift of log(K) steps, which
+// does not depend on the number of flows.
+template <typename Key>
+struct HeavyHitters {
+public:
+    struct Entry {
+        Key key;
+        uint64_t hash;
+        uint64_t rate;
+        uint32_t drops;
+        uint32_t marks;
+    };
+
+    HeavyHitters(uint32_t k) : m_k(k) {
+        m_width = SKETCH_MIN_WIDTH;
+        while (m_width < 16 * m_k)
+            m_width <<= 1;
+
+        m_index_size = 4;
+        while (m_index_size < 2 * m_k)
+            m_index_size <<= 1;
+
+        m_rate = new uint64_t[SKETCH_DEPTH * m_width];
+        m_drops = new uint32_t[SKETCH_DEPTH * m_width];
+        m_marks = new uint32_t[SKETCH_DEPTH * m_width];
+        m_heap = new Entry[m_k];
+        m_index = new int32_t[m_index_size];
+    }
+
+    void init() {
+        bzero(m_rate, SKETCH_DEPTH * m_width * sizeof(uint64_t));
+        bzero(m_drops, SKETCH_DEPTH * m_width * sizeof(uint32_t));
+        bzero(m_marks, SKETCH_DEPTH * m_width * sizeof(uint32_t));
+        memset(m_index, -1, m_index_size * sizeof(int32_t));
+        m_n = 0;
+        m_total = 0;
+    }
+
+    void update(const Key &key, uint64_t hash, uint32_t r, uint32_t d, uint32_t m) {
+        uint64_t est_rate = UINT64_MAX;
+        uint32_t est_drops = UINT32_MAX;
+        uint32_t est_marks = UINT32_MAX;
+
+        // double hashing gives the column for each row
+        uint32_t h1 = hash;
+        uint32_t h2 = (hash >> 32) | 1;
+        for (uint32_t row = 0; row < SKETCH_DEPTH; ++row) {
+            uint32_t i = row * m_width + ((h1 + row * h2) & (m_width - 1));
+            m_rate[i] += r;
+            m_drops[i] += d;
+            m_marks[i] += m;
+            if (m_rate[i] < est_rate) est_rate = m_rate[i];
+            if (m_drops[i] < est_drops) est_drops = m_drops[i];
+            if (m_marks[i] < est_marks) est_marks = m_marks[i];
+        }
+
+        m_total += r;
+
+        uint32_t slot = find(key, hash);
+        if (m_index[slot] != -1) {
+            Entry &e = m_heap[m_index[slot]];
+            e.rate += r;
+            e.drops += d;
+            e.marks += m;
+            siftDown(m_index[slot]);
+            return;
+        }
+
+        uint32_t pos;
+        if (m_n < m_k) {
+            pos = m_n++;
+        } else if (m_k > 0 && est_rate > m_heap[0].rate) {
+            // replace the smallest of the current heavy hitters
+            remove(m_heap[0].key, m_heap[0].hash);
+            slot = find(key, hash);
+            pos = 0;
+        } else {
+            return;
+        }
+
+        m_heap[pos].key = key;
+        m_heap[pos].hash = hash;
+        m_heap[pos].rate = est_rate;
+        m_heap[pos].drops = est_drops;
+        m_heap[pos].marks = est_marks;
+        m_index[slot] = pos;
+
+        if (pos == 0)
+            siftDown(0);
+        else
+            siftUp(pos);
+    }
+
+    // the tracked flows, in no particular order
+    uint32_t size() const { return m_n; }
+    const Entry &at(uint32_t i) const { return m_heap[i]; }
+
+    // the estimate of a flow's rate exceeds the true rate by at most this
+    // (with probability 1 - e^-SKETCH_DEPTH)
+    uint64_t errorBound() const {
+        return m_total * 2.718281828 / m_width;
+    }
+
+private:
+    uint32_t m_k;
+    uint32_t m_width;
+    uint32_t m_index_size;
+    uint32_t m_n;
+    uint64_t m_total;
+
+    uint64_t *m_rate;
+    uint32_t *m_drops;
+    uint32_t *m_marks;
+    Entry *m_heap;
+    int32_t *m_index; // position in m_heap, -1 for unused slots
+
+    // slot holding the key, or the empty slot where it should go
+    uint32_t find(const Key &key, uint64_t hash) const {
+        uint32_t slot = hash & (m_index_size - 1);
+        while (m_index[slot] != -1 && !(m_heap[m_index[slot]].key == key))
+            slot = (slot + 1) & (m_index_size - 1);
+        return slot;
+    }
+
+    // remove a key from the index, shifting back later entries in the
+    // probe sequence so lookups don't need tombstones
+    void remove(const Key &key, uint64_t hash) {
+        uint32_t slot = find(key, hash);
+        if (m_index[slot] == -1)
+            return;
+
+        uint32_t next = slot;
+        while (1) {
+            next = (next + 1) & (m_index_size - 1);
+            if (m_index[next] == -1)
+                break;
+            uint32_t home = m_heap[m_index[next]].hash & (m_index_size - 1);
+            if (((next - home) & (m_index_size - 1)) >= ((next - slot) & (m_index_size - 1))) {
+                m_index[slot] = m_index[next];
+                slot = next;
+            }
+        }
+        m_index[slot] = -1;
+    }
+
+    void swap(uint32_t a, uint32_t b) {
+        uint32_t slot_a = find(m_heap[a].key, m_heap[a].hash);
+        uint32_t slot_b = find(m_heap[b].key, m_heap[b].hash);
+        Entry tmp = m_heap[a];
+        m_heap[a] = m_heap[b];
+        m_heap[b] = tmp;
+        m_index[slot_a] = b;
+        m_index[slot_b] = a;
+    }
+
+    void siftUp(uint32_t pos) {
+        while (pos > 0) {
+            uint32_t parent = (pos - 1) / 2;
+            if (m_heap[parent].rate <= m_heap[pos].rate)
+                break;
+            swap(pos, parent);
+            pos = parent;
+        }
+    }
+
+    void siftDown(uint32_t pos) {
+        while (1) {
+            uint32_t smallest = pos;
+            uint32_t l = 2 * pos + 1;
+            uint32_t r = l + 1;
+            if (l < m_n && m_heap[l].rate < m_heap[smallest].rate)
+                smallest = l;
+            if (r < m_n && m_heap[r].rate < m_heap[smallest].rate)
+                smallest = r;
+            if (smallest == pos)
+                break;
+            swap(pos, smallest);
+            pos = smallest;
+        }
+    }
+};
+
+#endif // SKETCH_H
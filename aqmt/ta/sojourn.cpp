@@ -0,0 +1,125 @@
+#include "sojourn.h"
+
+SojournMatcher::SojournMatcher(uint32_t timeout_ms, bool ipclass)
+{
+    pthread_mutex_init(&m_lock, NULL);
+    m_timeout = (uint64_t) timeout_ms * 1000;
+    m_ipclass = ipclass;
+    m_ring.resize(SOJOURN_ENTRIES);
+    m_buckets.assign(SOJOURN_ENTRIES, -1);
+    m_mask = SOJOURN_ENTRIES - 1;
+    m_head = 0;
+    m_tail = 0;
+    m_pending[0] = 0;
+    m_pending[1] = 0;
+    matched = 0;
+    inferred = 0;
+    unmatched_egress = 0;
+    overflow = 0;
+}
+
+uint64_t SojournMatcher::key(const u_char *buffer, uint32_t caplen, const PacketInfo &pi)
+{
+    uint64_t h = pi.sd.hash();
+    if (pi.l4off != 0) {
+        h ^= pi.len - pi.l4off;
+        uint32_t off = pi.l4off + PORTS_LEN;
+        uint32_t end = off + SOJOURN_KEY_BYTES;
+        if (end > caplen)
+            end = caplen;
+        for (; off < end; ++off)
+            h = (h ^ buffer[off]) * 0x100000001b3ULL;
+    } else {
+        h ^= pi.len;
+    }
+
+    // murmur3 finalizer, the buckets use the low bits
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    // 0 marks free entries, keep the low bits for the buckets
+    return h != 0 ? h : 1;
+}
+
+bool SojournMatcher::add(const PacketInfo &pi, uint64_t key, uint64_t now, bool egress, SojournMatch *m)
+{
+    pthread_mutex_lock(&m_lock);
+    expire(now);
+
+    // the oldest copy from the other side, the chains are newest first
+    int32_t found = -1;
+    for (int32_t i = m_buckets[key & m_mask]; i != -1; i = m_ring[i].next) {
+        if (m_ring[i].key == key && m_ring[i].egress != egress)
+            found = i;
+    }
+
+    if (found == -1) {
+        uint32_t slot = m_head++ & m_mask;
+        SojournEntry &e = m_ring[slot];
+        e.key = key;
+        e.time = now;
+        e.egress = egress;
+        e.ecn = ((m_ipclass ? pi.addrbits : pi.tos) & 3) != 0;
+        e.tos = pi.tos;
+        e.next = m_buckets[key & m_mask];
+        m_buckets[key & m_mask] = slot;
+        pthread_mutex_unlock(&m_lock);
+        return false;
+    }
+
+    SojournEntry &e = m_ring[found];
+    uint64_t in = egress ? e.time : now;
+    uint64_t out = egress ? now : e.time;
+    bool ecn = egress ? e.ecn : ((m_ipclass ? pi.addrbits : pi.tos) & 3) != 0;
+    m->pi = pi;
+    if (!egress)
+        m->pi.tos = e.tos;
+    m->time = out;
+    unlink(found);
+
+    // the packet carries what fits of the pending drops, as the drops
+    // field of testbed_add_metrics, and the rest waits for the next
+    uint64_t sojourn_ns = out > in ? (out - in) * NSEC_PER_US : 0;
+    uint16_t id = testbed_encoding::encode(sojourn_ns, m_pending[ecn]);
+    m_pending[ecn] -= decodeDrops(testbed_encoding::drops_code(id));
+    m->pi.metrics = id;
+    matched++;
+
+    pthread_mutex_unlock(&m_lock);
+    return true;
+}
+
+// Unmatched ingress entries older than the timeout were dropped. The
+// times of the two sides only differ by the capture delays, so the time
+// of the newest packet from either side is used.
+void SojournMatcher::expire(uint64_t now)
+{
+    while (m_tail != m_head) {
+        uint32_t slot = m_tail & m_mask;
+        SojournEntry &e = m_ring[slot];
+        bool full = m_head - m_tail == SOJOURN_ENTRIES;
+        if (e.key != 0) {
+            if (!full && e.time + m_timeout >= now)
+                break;
+            if (full)
+                overflow++;
+            else if (e.egress)
+                unmatched_egress++;
+            else {
+                m_pending[e.ecn]++;
+                inferred++;
+            }
+            unlink(slot);
+        }
+        m_tail++;
+    }
+}
+
+void SojournMatcher::unlink(uint32_t slot)
+{
+    int32_t *p = &m_buckets[m_ring[slot].key & m_mask];
+    while (*p != (int32_t) slot)
+        p = &m_ring[*p].next;
+    *p = m_ring[slot].next;
+    m_ring[slot].key = 0;
+}
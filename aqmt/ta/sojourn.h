@@ -0,0 +1,85 @@
+#ifndef SOJOURN_H
+#define SOJOURN_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <vector>
+
+#include "analyzer.h"
+#include "packet.h"
+
+// Two point queue delay measurement (-I)
+//
+// For AQMs that don't write the queue delay into the packets (see
+// testbed_add_metrics), the packets are captured both before (ingress)
+// and after (egress) the AQM, and the two copies of each packet are
+// matched by a hash of the fields the AQM doesn't change. The time
+// between them is the sojourn time, and a packet seen at ingress but
+// not at egress within the timeout was dropped.
+
+#define SOJOURN_ENTRIES (1 << 18) // packets waiting for their other copy
+#define SOJOURN_TIMEOUT 1000      // ms, default
+#define SOJOURN_KEY_BYTES 16      // of the transport header after the ports
+
+// A packet seen on one side only so far
+struct SojournEntry {
+public:
+    uint64_t key;  // 0 when matched or expired
+    uint64_t time; // us
+    int32_t next;  // in the bucket, -1 at the end
+    bool egress;
+    bool ecn;      // queue at ingress, CE marking doesn't move it
+    uint8_t tos;   // of the egress copy, which may be CE marked
+};
+
+// What a packet completed: the packet that completed it, with the TOS
+// of the egress copy, and the sojourn time and the drops inferred in
+// its queue since the last match as metrics, as testbed_add_metrics
+// would have written them. The rest of the headers are the same in
+// both copies, so it can be counted with either frame.
+struct SojournMatch {
+public:
+    PacketInfo pi;
+    uint64_t time; // at egress, us
+};
+
+// The entries are kept in a ring in the order they were added, which is
+// the time order, with chains by key to find them. Matched entries are
+// left in the ring until the oldest unmatched one before them expires,
+// so the ring bounds the packets in the timeout, not in the queue. When
+// it is full the oldest entry is dropped without inferring a drop.
+struct SojournMatcher {
+public:
+    SojournMatcher(uint32_t timeout_ms, bool ipclass);
+
+    // true if the packet completed a pair, which is then in *m
+    bool add(const PacketInfo &pi, uint64_t key, uint64_t now, bool egress, SojournMatch *m);
+
+    // hash of the flow, transport length and SOJOURN_KEY_BYTES of the
+    // transport header after the ports (for TCP the sequence and ACK
+    // numbers, flags, window and checksum), never 0. The TOS, TTL and
+    // IPv4 id are left out, as they can change on the way.
+    static uint64_t key(const u_char *buffer, uint32_t caplen, const PacketInfo &pi);
+
+    // under the lock of add, read them when the capture has stopped
+    uint64_t matched;
+    uint64_t inferred;         // drops
+    uint64_t unmatched_egress; // not seen at ingress within the timeout
+    uint64_t overflow;         // dropped from a full ring
+
+private:
+    pthread_mutex_t m_lock;
+    uint64_t m_timeout; // us
+    bool m_ipclass;
+    std::vector<SojournEntry> m_ring;
+    std::vector<int32_t> m_buckets;
+    uint32_t m_mask;
+    uint64_t m_head; // next to add
+    uint64_t m_tail; // oldest
+    uint32_t m_pending[2]; // inferred drops not given to a packet yet, by queue
+
+    void expire(uint64_t now);
+    void unlink(uint32_t slot);
+};
+
+#endif // SOJOURN_H
@@ -0,0 +1,228 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+TraceWriter::TraceWriter(pthread_mutex_t *lock)
+{
+    m_lock = lock;
+    m_size = 0;
+    m_keep = 0;
+    m_ipclass = false;
+    m_clock_offset = 0;
+    m_seq = 0;
+    m_base = 0;
+    m_start = 0;
+    m_samples = 0;
+    m_lost = 0;
+    m_flows_written = 0;
+    m_flows_file = NULL;
+}
+
+bool TraceWriter::open(const std::string &folder, uint32_t size_mb, uint32_t keep, bool ipclass)
+{
+    m_folder = folder;
+    m_size = (size_t) size_mb << 20;
+    m_keep = keep;
+    m_ipclass = ipclass;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    m_clock_offset = (int64_t) (now.tv_sec * US_PER_S + now.tv_usec) - (int64_t) getStamp();
+
+    std::string path = folder + "/flows";
+    m_flows_file = fopen(path.c_str(), "w");
+    if (m_flows_file == NULL) {
+        fprintf(stderr, "Can't open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // the first file and the one after it are ready before we start
+    return openFile(&m_cur) && openFile(&m_next);
+}
+
+void TraceWriter::sample(uint64_t time)
+{
+    time += m_clock_offset;
+    if (m_start == 0) {
+        m_start = time;
+        if (m_cur.hdr != NULL)
+            m_cur.hdr->start = time;
+    }
+
+    TraceRecord *r = record(time);
+    if (r == NULL)
+        return;
+
+    memset(r, 0, sizeof(*r));
+    r->time = time >= m_base ? time - m_base : 0;
+    r->flow = m_samples++;
+    r->flags = TRACE_SAMPLE;
+    m_cur.pos = r + 1;
+
+    m_cur.hdr->records = m_cur.pos - (TraceRecord *) (m_cur.hdr + 1);
+}
+
+// The current file is full, its times can't reach time, or its base
+// isn't set yet
+TraceRecord *TraceWriter::slowPath(uint64_t time)
+{
+    if (m_cur.hdr == NULL) {
+        m_lost++;
+        return NULL;
+    }
+
+    bool expired = m_cur.hdr->base != 0 && time > m_base && time - m_base > UINT32_MAX;
+    if (m_cur.pos == m_cur.end || expired) {
+        // the full file is handed over to maintain, one at a time
+        if (m_next.hdr == NULL || m_full.hdr != NULL) {
+            m_lost++;
+            return NULL;
+        }
+
+        m_cur.hdr->records = m_cur.pos - (TraceRecord *) (m_cur.hdr + 1);
+        m_full = m_cur;
+        m_cur = m_next;
+        m_next = TraceFile();
+        m_cur.hdr->start = m_start;
+    }
+
+    if (m_cur.hdr->base == 0)
+        m_cur.hdr->base = time;
+    m_base = m_cur.hdr->base;
+    return m_cur.pos;
+}
+
+void TraceWriter::maintain()
+{
+    pthread_mutex_lock(m_lock);
+    TraceFile full = m_full;
+    m_full = TraceFile();
+    bool need_next = m_next.hdr == NULL;
+    for (uint32_t i = m_flows_written; i < m_flows.size(); ++i)
+        m_new_flows.push_back(m_flows.begin()[i].key);
+    pthread_mutex_unlock(m_lock);
+
+    if (full.hdr != NULL)
+        closeFile(&full);
+
+    if (need_next) {
+        TraceFile next;
+        if (openFile(&next)) {
+            pthread_mutex_lock(m_lock);
+            m_next = next;
+            pthread_mutex_unlock(m_lock);
+        }
+    }
+
+    writeFlows();
+}
+
+// when the capture has stopped
+void TraceWriter::close()
+{
+    closeFile(&m_full);
+    closeFile(&m_cur);
+
+    // prepared but not used
+    if (m_next.hdr != NULL) {
+        uint32_t seq = m_next.seq;
+        closeFile(&m_next);
+        unlink((m_folder + "/trace." + std::to_string(seq)).c_str());
+    }
+
+    for (uint32_t i = m_flows_written; i < m_flows.size(); ++i)
+        m_new_flows.push_back(m_flows.begin()[i].key);
+    writeFlows();
+    fclose(m_flows_file);
+    m_flows_file = NULL;
+}
+
+bool TraceWriter::openFile(TraceFile *f)
+{
+    std::string path = m_folder + "/trace." + std::to_string(m_seq);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // reserve the blocks now, so the records never wait for the file
+    // system, and map it populated so they don't fault either
+    int err = posix_fallocate(fd, 0, m_size);
+    if (err != 0) {
+        fprintf(stderr, "Can't allocate %zu bytes for %s: %s\n", m_size, path.c_str(), strerror(err));
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+
+    void *p = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s: %s\n", path.c_str(), strerror(errno));
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+    madvise(p, m_size, MADV_SEQUENTIAL);
+
+    TraceHeader *hdr = (TraceHeader *) p;
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->version = TRACE_VERSION;
+    hdr->record_len = sizeof(TraceRecord);
+    hdr->seq = m_seq;
+    hdr->qdelay_m = QDELAY_M;
+    hdr->qdelay_e = QDELAY_E;
+    hdr->drops_m = DROPS_M;
+    hdr->drops_e = DROPS_E;
+    hdr->ipclass = m_ipclass;
+
+    f->fd = fd;
+    f->seq = m_seq;
+    f->hdr = hdr;
+    f->pos = (TraceRecord *) (hdr + 1);
+    f->end = f->pos + (m_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    f->size = m_size;
+
+    // the oldest file goes when the set is full
+    if (m_keep > 0 && m_seq >= m_keep)
+        unlink((m_folder + "/trace." + std::to_string(m_seq - m_keep)).c_str());
+    m_seq++;
+    return true;
+}
+
+// cuts the file after the last record, and starts writing it out
+void TraceWriter::closeFile(TraceFile *f)
+{
+    if (f->hdr == NULL)
+        return;
+
+    uint64_t records = f->pos - (TraceRecord *) (f->hdr + 1);
+    f->hdr->records = records;
+    munmap(f->hdr, f->size);
+
+    off_t len = sizeof(TraceHeader) + records * sizeof(TraceRecord);
+    if (ftruncate(f->fd, len) != 0)
+        fprintf(stderr, "Can't truncate trace.%u: %s\n", f->seq, strerror(errno));
+    sync_file_range(f->fd, 0, len, SYNC_FILE_RANGE_WRITE);
+    ::close(f->fd);
+    *f = TraceFile();
+}
+
+void TraceWriter::writeFlows()
+{
+    char src[INET6_ADDRSTRLEN];
+    char dst[INET6_ADDRSTRLEN];
+
+    for (const SrcDst &sd: m_new_flows) {
+        fprintf(m_flows_file, "%u %u %s %u %s %u\n", m_flows_written++, sd.m_proto,
+                IPtoBuf(sd.m_srcip, src), sd.m_srcport, IPtoBuf(sd.m_dstip, dst), sd.m_dstport);
+    }
+    m_new_flows.clear();
+    fflush(m_flows_file);
+}
@@ -0,0 +1,149 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "analyzer.h"
+
+// Per packet trace of the analyzer (-w), read back by ta_trace
+//
+// The trace is a set of files trace.0, trace.1, .. in its folder, each
+// a TraceHeader followed by fixed size records, and a text file "flows"
+// giving the flow of each flow index:
+//   <flow index> <proto number> <src ip> <src port> <dst ip> <dst port>
+//
+// The records are written in the order the packets are counted, with a
+// TRACE_SAMPLE record at each sample boundary, so the samples can be
+// rebuilt exactly as the analyzer saw them.
+
+#define TRACE_MAGIC "TATRACE"
+#define TRACE_VERSION 1
+#define TRACE_FILE_MB 256 // default size of each file
+
+// TraceRecord::flags
+#define TRACE_CLASS 3     // queue, the ECN bits or address bits with ipclass
+#define TRACE_CE 4        // ECN CE
+#define TRACE_SAMPLE 0x80 // sample boundary, flow is the id of the next sample
+
+// 64 bytes, the records start right after it
+struct TraceHeader {
+public:
+    char magic[8];
+    uint32_t version;
+    uint32_t record_len;
+    uint64_t base;    // us since the epoch, record times are relative to it
+    uint64_t start;   // time of the first sample boundary, 0 until known
+    uint64_t records; // written, updated at each sample boundary
+    uint32_t seq;     // number of the file in the set
+    uint8_t qdelay_m; // metrics layout, see numbers.h
+    uint8_t qdelay_e;
+    uint8_t drops_m;
+    uint8_t drops_e;
+    uint8_t ipclass;
+    uint8_t pad[15];
+};
+
+// one packet
+struct TraceRecord {
+public:
+    uint32_t time;    // us since TraceHeader::base
+    uint32_t flow;    // index in the flows file
+    uint16_t len;     // bytes on the link, at most 65535
+    uint16_t metrics; // qdelay and drops, as in the packet
+    uint8_t flags;
+    uint8_t pad[3];
+};
+
+// A preallocated, memory mapped trace file
+struct TraceFile {
+public:
+    int fd;
+    uint32_t seq;
+    TraceHeader *hdr;
+    TraceRecord *pos; // next record
+    TraceRecord *end;
+    size_t size;      // of the mapping
+
+    TraceFile() : fd(-1), seq(0), hdr(NULL), pos(NULL), end(NULL), size(0) {}
+};
+
+// Writes the trace. add() and sample() are called with tp->m_mutex held,
+// and only write to memory. Opening the next file, and truncating and
+// closing the full ones, is left to maintain() in the reporting thread,
+// so the capture thread never waits for the disk. Records are lost (and
+// counted) if a file fills up before the next one is ready.
+struct TraceWriter {
+public:
+    TraceWriter(pthread_mutex_t *lock);
+
+    // keeps the last `keep` files of size_mb each, or all if 0
+    bool open(const std::string &folder, uint32_t size_mb, uint32_t keep, bool ipclass);
+
+    // time is the capture time in us since the epoch
+    void add(const SrcDst &sd, uint64_t hash, uint64_t time, uint32_t len, uint16_t metrics, uint8_t flags) {
+        TraceRecord *r = record(time);
+        if (r == NULL)
+            return;
+
+        bool inserted;
+        uint32_t &flow = m_flows.insert(sd, hash, m_flows.size(), &inserted);
+
+        // packets captured before the base are put at the base
+        r->time = time >= m_base ? time - m_base : 0;
+        r->flow = flow;
+        r->len = len > UINT16_MAX ? UINT16_MAX : len;
+        r->metrics = metrics;
+        r->flags = flags;
+        m_cur.pos = r + 1;
+    }
+
+    // sample boundary at time (CLOCK_MONOTONIC in us, as getStamp)
+    void sample(uint64_t time);
+
+    // opens the next file and closes full ones, in the reporting thread
+    void maintain();
+    void close();
+
+    uint64_t lost() const { return m_lost; }
+
+private:
+    pthread_mutex_t *m_lock;
+    std::string m_folder;
+    size_t m_size;
+    uint32_t m_keep;
+    bool m_ipclass;
+    int64_t m_clock_offset; // CLOCK_REALTIME - CLOCK_MONOTONIC in us
+
+    // m_cur and m_next are handed over under the lock
+    TraceFile m_cur;
+    TraceFile m_next;  // ready for when m_cur is full
+    TraceFile m_full;  // to be closed by maintain
+    uint32_t m_seq;    // of the next file to open
+    uint64_t m_base;   // of m_cur
+    uint64_t m_start;
+    uint32_t m_samples;
+    uint64_t m_lost;
+
+    FlowTable<SrcDst,uint32_t> m_flows; // flow -> index, for the whole run
+    uint32_t m_flows_written;
+    std::vector<SrcDst> m_new_flows;
+    FILE *m_flows_file;
+
+    // the record to write at time, NULL if there is no room
+    TraceRecord *record(uint64_t time) {
+        if (__builtin_expect(m_cur.pos == m_cur.end || time - m_base > UINT32_MAX, 0))
+            return slowPath(time);
+        return m_cur.pos;
+    }
+
+    TraceRecord *slowPath(uint64_t time);
+    bool openFile(TraceFile *f);
+    void closeFile(TraceFile *f);
+    void writeFlows();
+};
+
+#endif // TRACE_H
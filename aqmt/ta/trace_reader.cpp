@@ -0,0 +1,364 @@
+// Reads a per packet trace written by the analyzer with -w (see trace.h)
+// and writes the queue, rate and flow files of each sample, as the
+// analyzer does. The samples are the ones the analyzer had, so the
+// files are the same as the ones written while capturing, except that
+// drops always come from the packets (not -c).
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "analyzer.h"
+#include "trace.h"
+
+void usage(int argc, char* argv[])
+{
+    printf("Usage: %s [options] <trace folder> <output folder>\n", argv[0]);
+    printf("Options:\n");
+    printf("  -p <bits>  queue delay histogram precision in mantissa bits (default all encoded bits)\n");
+    printf("  -r <us>    queue delay histogram range, larger delays go in the last bin (default no limit)\n");
+    exit(1);
+}
+
+static void openFileW(std::ofstream &file, const std::string &filename)
+{
+    file.open(filename.c_str());
+    if (!file.is_open()) {
+        std::cerr << "Error opening file for writing: " << filename << std::endl;
+        exit(1);
+    }
+}
+
+// the flows file, flow index -> flow
+static std::vector<SrcDst> readFlows(const std::string &file)
+{
+    std::vector<SrcDst> flows;
+    std::ifstream f(file.c_str());
+    if (!f.is_open()) {
+        std::cerr << "Can't read " << file << std::endl;
+        exit(1);
+    }
+
+    uint32_t index, proto, srcport, dstport;
+    std::string srcip, dstip;
+    while (f >> index >> proto >> srcip >> srcport >> dstip >> dstport) {
+        IPAddr ip[2];
+        const std::string *s[2] = {&srcip, &dstip};
+        for (int i = 0; i < 2; ++i) {
+            struct in_addr a4;
+            uint8_t a6[16];
+            if (inet_pton(AF_INET, s[i]->c_str(), &a4) == 1)
+                ip[i] = IPAddr(a4.s_addr);
+            else if (inet_pton(AF_INET6, s[i]->c_str(), a6) == 1)
+                ip[i] = IPAddr(a6);
+        }
+
+        if (index >= flows.size())
+            flows.resize(index + 1);
+        flows[index] = SrcDst(proto, ip[0], srcport, ip[1], dstport);
+    }
+    return flows;
+}
+
+// the numbers of the trace files in the folder, oldest first
+static std::vector<uint32_t> findTraceFiles(const std::string &folder)
+{
+    std::vector<uint32_t> seqs;
+    DIR *dir = opendir(folder.c_str());
+    if (dir == NULL) {
+        std::cerr << "Can't read " << folder << std::endl;
+        exit(1);
+    }
+
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        char *end;
+        if (strncmp(e->d_name, "trace.", 6) != 0)
+            continue;
+        uint32_t seq = strtoul(e->d_name + 6, &end, 10);
+        if (end != e->d_name + 6 && *end == '\0')
+            seqs.push_back(seq);
+    }
+    closedir(dir);
+
+    std::sort(seqs.begin(), seqs.end());
+    return seqs;
+}
+
+struct QueueFiles {
+public:
+    std::ofstream packets[4]; // ecn00 to ecn11
+    std::ofstream drops[4];
+
+    void open(const std::string &folder, const QdelayLayout &layout) {
+        const char *names[4] = {"ecn00", "ecn01", "ecn10", "ecn11"};
+        for (int i = 0; i < 4; ++i) {
+            openFileW(packets[i], folder + "/queue_packets_" + names[i]);
+            openFileW(drops[i], folder + "/queue_drops_" + names[i]);
+
+            // same header as the analyzer
+            packets[i] << layout.nbins;
+            drops[i] << layout.nbins;
+            for (uint32_t j = 0; j < layout.nbins; ++j) {
+                packets[i] << " " << layout.lower[j];
+                drops[i] << " " << layout.lower[j];
+            }
+            packets[i] << std::endl;
+            drops[i] << std::endl;
+        }
+    }
+
+    void write(const DataBlock *db, uint64_t time_ms) {
+        const uint32_t *qs[4] = {db->qs.ecn00, db->qs.ecn01, db->qs.ecn10, db->qs.ecn11};
+        const uint32_t *d_qs[4] = {db->d_qs.ecn00, db->d_qs.ecn01, db->d_qs.ecn10, db->d_qs.ecn11};
+        for (int i = 0; i < 4; ++i) {
+            packets[i] << time_ms;
+            drops[i] << time_ms;
+            for (uint32_t j = 0; j < db->qs.nbins; ++j) {
+                packets[i] << " " << qs[i][j];
+                drops[i] << " " << d_qs[i][j];
+            }
+            packets[i] << std::endl;
+            drops[i] << std::endl;
+        }
+    }
+};
+
+int main(int argc, char **argv)
+{
+    Options opts;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:r:")) != -1) {
+        switch (opt) {
+        case 'p':
+            opts.qdelay_precision = atoi(optarg);
+            break;
+        case 'r':
+            opts.qdelay_range = atoi(optarg);
+            break;
+        default:
+            usage(argc, argv);
+        }
+    }
+
+    if (argc - optind < 2)
+        usage(argc, argv);
+
+    std::string trace_folder = argv[optind];
+    std::string folder = argv[optind + 1];
+    mkdir(folder.c_str(), 0777);
+
+    QdelayLayout layout;
+    layout.init(opts.qdelay_precision, opts.qdelay_range);
+
+    std::vector<SrcDst> flows = readFlows(trace_folder + "/flows");
+    std::vector<uint32_t> seqs = findTraceFiles(trace_folder);
+    if (seqs.empty()) {
+        std::cerr << "No trace files in " << trace_folder << std::endl;
+        exit(1);
+    }
+
+    QueueFiles f_queue;                    f_queue.open(folder, layout);
+    std::ofstream f_packets_ecn;           openFileW(f_packets_ecn,           folder + "/packets_ecn");
+    std::ofstream f_packets_nonecn;        openFileW(f_packets_nonecn,        folder + "/packets_nonecn");
+    std::ofstream f_rate_ecn;              openFileW(f_rate_ecn,              folder + "/rate_ecn");
+    std::ofstream f_rate_nonecn;           openFileW(f_rate_nonecn,           folder + "/rate_nonecn");
+    std::ofstream f_drops_ecn;             openFileW(f_drops_ecn,             folder + "/drops_ecn");
+    std::ofstream f_drops_nonecn;          openFileW(f_drops_nonecn,          folder + "/drops_nonecn");
+    std::ofstream f_marks_ecn;             openFileW(f_marks_ecn,             folder + "/marks_ecn");
+    std::ofstream f_rate;                  openFileW(f_rate,                  folder + "/rate");
+
+    DataBlock db(layout.nbins, opts);
+    db.init();
+    FlowHistory fd_pf_ecn;
+    FlowHistory fd_pf_nonecn;
+    std::vector<uint32_t> sample_ids;
+    std::vector<uint64_t> sample_times;
+
+    uint64_t start = 0;
+    uint64_t last = 0; // time of the last sample boundary, 0 before the first
+    uint64_t records = 0;
+    uint64_t skipped = 0;
+
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        std::string path = trace_folder + "/trace." + std::to_string(seqs[i]);
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(TraceHeader)) {
+            std::cerr << "Can't read " << path << std::endl;
+            exit(1);
+        }
+
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            std::cerr << "Can't map " << path << std::endl;
+            exit(1);
+        }
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+        const TraceHeader *hdr = (const TraceHeader *) p;
+        if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != TRACE_VERSION || hdr->record_len != sizeof(TraceRecord)) {
+            std::cerr << path << " is not a trace of this version" << std::endl;
+            exit(1);
+        }
+        if (hdr->qdelay_m != QDELAY_M || hdr->qdelay_e != QDELAY_E ||
+            hdr->drops_m != DROPS_M || hdr->drops_e != DROPS_E) {
+            std::cerr << path << " has another metrics layout, see METRICS_FLAGS in the Makefile" << std::endl;
+            exit(1);
+        }
+        if (i > 0 && seqs[i] != seqs[i - 1] + 1)
+            std::cerr << "Trace files missing before " << path << std::endl;
+
+        // the records up to the last sample boundary if the analyzer
+        // didn't get to close the file
+        uint64_t n = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+        if (hdr->records < n)
+            n = hdr->records;
+        if (start == 0)
+            start = hdr->start;
+
+        const TraceRecord *rec = (const TraceRecord *) (hdr + 1);
+        for (uint64_t j = 0; j < n; ++j) {
+            const TraceRecord &r = rec[j];
+            uint64_t time = hdr->base + r.time;
+
+            if (r.flags & TRACE_SAMPLE) {
+                if (start == 0)
+                    start = time;
+
+                if (last != 0) {
+                    uint64_t samplelen = time - last;
+                    uint64_t time_ms = (time - start) / 1000;
+                    uint32_t id = r.flow - 1;
+                    sample_ids.push_back(id);
+                    sample_times.push_back(time_ms);
+
+                    fd_pf_ecn.newSample();
+                    fd_pf_nonecn.newSample();
+                    for (int k = 0; k < 2; ++k) {
+                        FlowHistory *fd_pf = k ? &fd_pf_ecn : &fd_pf_nonecn;
+                        for (auto &e: k ? db.fm.ecn_rate : db.fm.nonecn_rate) {
+                            if (!isFlowProto(e.key.m_proto))
+                                continue;
+                            FlowData fdata = e.value;
+                            fdata.rate = fdata.rate * 1000000 / samplelen;
+                            fd_pf->add(e.key, fdata);
+                        }
+                    }
+
+                    uint64_t rate_ecn = db.ecn_tot.rate * 1000000 / samplelen;
+                    uint64_t rate_nonecn = db.nonecn_tot.rate * 1000000 / samplelen;
+
+                    f_queue.write(&db, time_ms);
+                    f_rate_ecn     << id << " " << time_ms << " " << rate_ecn << std::endl;
+                    f_rate_nonecn  << id << " " << time_ms << " " << rate_nonecn << std::endl;
+                    f_drops_ecn    << id << " " << time_ms << " " << db.ecn_tot.drops << std::endl;
+                    f_drops_nonecn << id << " " << time_ms << " " << db.nonecn_tot.drops << std::endl;
+                    f_marks_ecn    << id << " " << time_ms << " " << db.ecn_tot.marks << std::endl;
+                    f_rate         << id << " " << time_ms << " " << (rate_ecn + rate_nonecn) << std::endl;
+                    f_packets_ecn << db.tot_packets_ecn << std::endl;
+                    f_packets_nonecn << db.tot_packets_nonecn << std::endl;
+                }
+
+                db.init();
+                last = time;
+                continue;
+            }
+
+            // packets before the first sample boundary were not counted
+            records++;
+            if (last == 0 || r.flow >= flows.size()) {
+                skipped++;
+                continue;
+            }
+
+            // as processPacket
+            const SrcDst &sd = flows[r.flow];
+            int drops = decodeDrops(testbed_encoding::drops_code(r.metrics));
+            int qdelay_bin = layout.bin[testbed_encoding::qdelay_code(r.metrics)];
+            uint64_t iplen = (uint64_t) r.len * 8;
+            uint32_t mark = (r.flags & TRACE_CE) != 0;
+            uint32_t *qs[4] = {db.qs.ecn00, db.qs.ecn01, db.qs.ecn10, db.qs.ecn11};
+            uint32_t *d_qs[4] = {db.d_qs.ecn00, db.d_qs.ecn01, db.d_qs.ecn10, db.d_qs.ecn11};
+            uint8_t cls = r.flags & TRACE_CLASS;
+            bool ecn = cls != 0;
+
+            qs[cls][qdelay_bin]++;
+            d_qs[cls][qdelay_bin] += drops;
+            (ecn ? db.tot_packets_ecn : db.tot_packets_nonecn)++;
+
+            if (isFlowProto(sd.m_proto)) {
+                ClassTotals &tot = ecn ? db.ecn_tot : db.nonecn_tot;
+                tot.rate += iplen;
+                tot.drops += drops;
+                tot.marks += mark;
+            }
+
+            bool inserted;
+            FlowTable<SrcDst,FlowData> &fmap = ecn ? db.fm.ecn_rate : db.fm.nonecn_rate;
+            FlowData &fdata = fmap.insert(sd, sd.hash(), FlowData(iplen, drops, mark), &inserted);
+            if (!inserted)
+                fdata.update(iplen, drops, mark);
+        }
+
+        munmap(p, st.st_size);
+    }
+
+    // as at the end of printInfo
+    std::ofstream f_flows_rate_ecn;     openFileW(f_flows_rate_ecn,      folder + "/flows_rate_ecn");
+    std::ofstream f_flows_rate_nonecn;  openFileW(f_flows_rate_nonecn,   folder + "/flows_rate_nonecn");
+    std::ofstream f_flows_drops_ecn;    openFileW(f_flows_drops_ecn,     folder + "/flows_drops_ecn");
+    std::ofstream f_flows_drops_nonecn; openFileW(f_flows_drops_nonecn,  folder + "/flows_drops_nonecn");
+    std::ofstream f_flows_marks_ecn;    openFileW(f_flows_marks_ecn,     folder + "/flows_marks_ecn");
+
+    for (size_t i = 0; i < sample_times.size(); i++) {
+        f_flows_rate_ecn << sample_ids[i] << " " << sample_times[i];
+        f_flows_drops_ecn << sample_ids[i] << " " << sample_times[i];
+        f_flows_marks_ecn << sample_ids[i] << " " << sample_times[i];
+        f_flows_rate_nonecn << sample_ids[i] << " " << sample_times[i];
+        f_flows_drops_nonecn << sample_ids[i] << " " << sample_times[i];
+
+        for (auto const& kv: fd_pf_ecn.columns) {
+            const FlowData &fdata = fd_pf_ecn.at(i, kv.second);
+            f_flows_rate_ecn << " " << fdata.rate;
+            f_flows_drops_ecn << " " << fdata.drops;
+            f_flows_marks_ecn << " " << fdata.marks;
+        }
+
+        for (auto const& kv: fd_pf_nonecn.columns) {
+            const FlowData &fdata = fd_pf_nonecn.at(i, kv.second);
+            f_flows_rate_nonecn << " " << fdata.rate;
+            f_flows_drops_nonecn << " " << fdata.drops;
+        }
+
+        f_flows_rate_ecn << std::endl;
+        f_flows_drops_ecn << std::endl;
+        f_flows_marks_ecn << std::endl;
+        f_flows_rate_nonecn << std::endl;
+        f_flows_drops_nonecn << std::endl;
+    }
+
+    std::ofstream f_flows_ecn;    openFileW(f_flows_ecn,    folder + "/flows_ecn");
+    std::ofstream f_flows_nonecn; openFileW(f_flows_nonecn, folder + "/flows_nonecn");
+
+    for (int k = 0; k < 2; ++k) {
+        std::ofstream &f = k ? f_flows_ecn : f_flows_nonecn;
+        for (auto const& kv: (k ? fd_pf_ecn : fd_pf_nonecn).columns)
+            f << getProtoRepr(kv.first.m_proto) << " " << IPtoString(kv.first.m_srcip) << " " << kv.first.m_srcport << " " << IPtoString(kv.first.m_dstip) << " " << kv.first.m_dstport << std::endl;
+    }
+
+    std::cout << "Samples: " << sample_times.size() << std::endl;
+    std::cout << "Packets: " << records << " (" << skipped << " outside the samples)" << std::endl;
+    return 0;
+}
@@ -139,6 +139,9 @@ class TestCase:
 
         pcapfilter = 'ip and dst net %s/24 and (src net %s/24 or src net %s/24) and (tcp or udp)' % (net_c, net_sa, net_sb)
 
+        # the ACKs going back, used by the analyzer to estimate the RTT of each flow
+        ackfilter = 'ip and src net %s/24 and (dst net %s/24 or dst net %s/24) and tcp' % (net_c, net_sa, net_sb)
+
         cmd = bash[
             '-c',
             """
@@ -146,10 +149,12 @@ class TestCase:
             set -e
             source aqmt-vars.sh
             mkdir -p '%s/ta'
-            sudo %s $IFACE_CLIENTS '%s' '%s/ta' %d %d
+            sudo %s -t '%s' -T '%s/details' $IFACE_CLIENTS '%s' '%s/ta' %d %d
             """ % (
                 self.test_folder,
                 os.path.join(os.path.dirname(__file__), 'ta/analyzer'),
+                ackfilter,
+                self.test_folder,
                 pcapfilter,
                 self.test_folder,
                 self.testenv.testbed.ta_delay,
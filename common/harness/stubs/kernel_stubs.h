@@ -0,0 +1,129 @@
+/* The parts of the kernel testbed.h uses, in user space. Each of the
+ * kernel headers it includes is a stub including this file.
+ */
+
+#ifndef KERNEL_STUBS_H
+#define KERNEL_STUBS_H
+
+#include <arpa/inet.h>
+#include <netinet/ip.h> /* struct iphdr has the kernel field names */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64; /* as in the kernel, for %llu */
+typedef long long s64;
+typedef uint16_t __u16;
+typedef uint32_t __u32;
+typedef unsigned long long __u64;
+typedef uint16_t __be16;
+typedef uint32_t __be32;
+typedef uint16_t __sum16;
+typedef s64 ktime_t;
+
+#define __force
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define READ_ONCE(x) (*(volatile __typeof__(x) *) &(x))
+
+#define ETH_P_IP   0x0800
+#define ETH_P_IPV6 0x86DD
+
+struct ipv6hdr {
+	u8 priority:4,
+	   version:4;
+	u8 flow_lbl[3];
+	__be16 payload_len;
+	u8 nexthdr;
+	u8 hop_limit;
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+};
+
+/* the network header is at data, and the protocol is the one after
+ * the VLAN tags
+ */
+struct sk_buff {
+	unsigned char *data;
+	__be16 protocol;
+	ktime_t tstamp;
+};
+
+static inline __be16 vlan_get_protocol(const struct sk_buff *skb)
+{
+	return skb->protocol;
+}
+
+static inline struct iphdr *ip_hdr(const struct sk_buff *skb)
+{
+	return (struct iphdr *) skb->data;
+}
+
+static inline struct ipv6hdr *ipv6_hdr(const struct sk_buff *skb)
+{
+	return (struct ipv6hdr *) skb->data;
+}
+
+static inline u8 ipv4_get_dsfield(const struct iphdr *iph)
+{
+	return iph->tos;
+}
+
+static inline u8 ipv6_get_dsfield(const struct ipv6hdr *ip6h)
+{
+	return ntohs(*(const __be16 *) ip6h) >> 4;
+}
+
+/* RFC 1624 eqn. 3, as the kernel */
+static inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new_)
+{
+	u32 s = (u16) ~*sum + (u16) ~old + new_;
+
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	*sum = ~s;
+}
+
+static inline u64 clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline u64 ktime_get_real_ns(void)
+{
+	return clock_ns(CLOCK_REALTIME);
+}
+
+static inline u64 ktime_get_mono_fast_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+static inline ktime_t ns_to_ktime(u64 ns)
+{
+	return ns;
+}
+
+static inline s64 ktime_to_ns(ktime_t kt)
+{
+	return kt;
+}
+
+static inline void __net_timestamp(struct sk_buff *skb)
+{
+	skb->tstamp = ktime_get_real_ns();
+}
+
+struct seq_file {
+	FILE *f;
+};
+
+#define seq_printf(seq, ...) fprintf((seq)->f, __VA_ARGS__)
+
+#endif /* KERNEL_STUBS_H */
@@ -0,0 +1 @@
+#include "kernel_stubs.h"
@@ -0,0 +1,225 @@
+/* Tests testbed_add_metrics off-kernel against the stub kernel headers,
+ * and times it. For random IPv4 and IPv6 packets it checks that:
+ *
+ * - the updated IPv4 header checksum equals a full recompute
+ * - the queue delay decodes to the time since the enqueue timestamp,
+ *   within the encoding precision
+ * - the drops carried by the packets and the ones still waiting add up
+ *   to the drops counted
+ * - only the lowest 16 bits of the IPv6 flow label change
+ *
+ *   ./testbed_harness [packets]
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "testbed.h"
+
+#define HARNESS_PACKETS 1000000
+#define HARNESS_MAX_DELAY_NS 200000000 /* 200 ms */
+#define HARNESS_BENCH_SKBS 1024
+
+static int failed;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		fprintf(stderr, __VA_ARGS__); \
+		failed = 1; \
+		return; \
+	} \
+} while (0)
+
+static u16 ip_csum(const struct iphdr *iph)
+{
+	const u16 *p = (const u16 *) iph;
+	u32 sum = 0;
+	int i;
+
+	for (i = 0; i < iph->ihl * 2; ++i)
+		sum += p[i];
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+static void random_iphdr(struct iphdr *iph, unsigned *seed)
+{
+	memset(iph, 0, sizeof(*iph));
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tos = rand_r(seed) & 0xff;
+	iph->tot_len = htons(40 + rand_r(seed) % 1460);
+	iph->id = rand_r(seed);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_TCP;
+	iph->saddr = rand_r(seed);
+	iph->daddr = rand_r(seed);
+	iph->check = ip_csum(iph);
+}
+
+/* adds up to 3 drops in the queue of the packet */
+static u32 random_drops(struct sk_buff *skb, struct testbed_metrics *testbed, unsigned *seed)
+{
+	u32 n = rand_r(seed) % 4;
+	u32 i;
+
+	for (i = 0; i < n; ++i)
+		testbed_inc_drop_count(skb, testbed);
+	return n;
+}
+
+static void check_qdelay(u16 id, u64 delay_ns, u64 elapsed_ns)
+{
+	u64 decoded = fl2int(METRICS_QDELAY(id), QDELAY_M, QDELAY_E);
+	u64 low = delay_ns >> QDELAY_SHIFT;
+	u64 high = (delay_ns + elapsed_ns) >> QDELAY_SHIFT;
+
+	/* the encoding keeps QDELAY_M bits after the leading one */
+	CHECK(decoded <= high && decoded + (low >> QDELAY_M) + 1 >= low,
+	      "qdelay %llu decoded from %#x, expected %llu to %llu\n",
+	      (unsigned long long) decoded, id, (unsigned long long) low, (unsigned long long) high);
+}
+
+static void test_ipv4(u32 packets, unsigned seed)
+{
+	struct testbed_metrics testbed;
+	struct iphdr iph;
+	struct sk_buff skb = { (unsigned char *) &iph, htons(ETH_P_IP), 0 };
+	u64 drops_total[2] = { 0, 0 };
+	u64 drops_carried[2] = { 0, 0 };
+	u32 i;
+
+	testbed_metrics_init(&testbed);
+
+	for (i = 0; i < packets; ++i) {
+		u64 delay_ns = rand_r(&seed) % HARNESS_MAX_DELAY_NS;
+		u64 start;
+		int ecn;
+		u16 id;
+
+		random_iphdr(&iph, &seed);
+		ecn = (iph.tos & 3) != 0;
+		drops_total[ecn] += random_drops(&skb, &testbed, &seed);
+
+		start = testbed_now_ns();
+		skb.tstamp = ns_to_ktime(start - delay_ns);
+		testbed_add_metrics(&skb, &testbed);
+		id = ntohs(iph.id);
+
+		/* over a valid header, with the checksum, the sum is 0 */
+		CHECK(ip_csum(&iph) == 0, "IPv4 checksum %#x is off by %#x\n", iph.check, ip_csum(&iph));
+		check_qdelay(id, delay_ns, testbed_now_ns() - start);
+		if (failed)
+			return;
+		drops_carried[ecn] += fl2int(METRICS_DROPS(id), DROPS_M, DROPS_E);
+	}
+
+	CHECK(drops_carried[1] + testbed.drops_ecn == drops_total[1] &&
+	      drops_carried[0] + testbed.drops_nonecn == drops_total[0],
+	      "drops carried %llu + %u and %llu + %u, counted %llu and %llu\n",
+	      (unsigned long long) drops_carried[1], testbed.drops_ecn,
+	      (unsigned long long) drops_carried[0], testbed.drops_nonecn,
+	      (unsigned long long) drops_total[1], (unsigned long long) drops_total[0]);
+	CHECK(testbed.drops_ecn_total == drops_total[1] && testbed.drops_nonecn_total == drops_total[0],
+	      "exact drop totals differ\n");
+}
+
+static void test_ipv6(u32 packets, unsigned seed)
+{
+	struct testbed_metrics testbed;
+	struct ipv6hdr ip6h;
+	struct sk_buff skb = { (unsigned char *) &ip6h, htons(ETH_P_IPV6), 0 };
+	u64 drops_total[2] = { 0, 0 };
+	u64 drops_carried[2] = { 0, 0 };
+	u32 i;
+
+	testbed_metrics_init(&testbed);
+
+	for (i = 0; i < packets; ++i) {
+		u64 delay_ns = rand_r(&seed) % HARNESS_MAX_DELAY_NS;
+		struct ipv6hdr before;
+		u64 start;
+		int ecn;
+		u16 id;
+
+		memset(&ip6h, 0, sizeof(ip6h));
+		ip6h.version = 6;
+		ip6h.priority = rand_r(&seed) & 0xf;
+		ip6h.flow_lbl[0] = rand_r(&seed);
+		ip6h.flow_lbl[1] = rand_r(&seed);
+		ip6h.flow_lbl[2] = rand_r(&seed);
+		ip6h.payload_len = htons(rand_r(&seed) % 1460);
+		ip6h.nexthdr = IPPROTO_TCP;
+		before = ip6h;
+		ecn = (ipv6_get_dsfield(&ip6h) & 3) != 0;
+		drops_total[ecn] += random_drops(&skb, &testbed, &seed);
+
+		start = testbed_now_ns();
+		skb.tstamp = ns_to_ktime(start - delay_ns);
+		testbed_add_metrics(&skb, &testbed);
+		id = (ip6h.flow_lbl[1] << 8) | ip6h.flow_lbl[2];
+
+		CHECK(memcmp(&ip6h, &before, 2) == 0 && memcmp(&ip6h.payload_len, &before.payload_len,
+		      sizeof(ip6h) - offsetof(struct ipv6hdr, payload_len)) == 0,
+		      "IPv6 header changed outside the flow label\n");
+		check_qdelay(id, delay_ns, testbed_now_ns() - start);
+		if (failed)
+			return;
+		drops_carried[ecn] += fl2int(METRICS_DROPS(id), DROPS_M, DROPS_E);
+	}
+
+	CHECK(drops_carried[1] + testbed.drops_ecn == drops_total[1] &&
+	      drops_carried[0] + testbed.drops_nonecn == drops_total[0],
+	      "IPv6 drops carried and waiting differ from the drops counted\n");
+}
+
+/* time per packet of testbed_add_metrics, with the packets in cache */
+static void bench(u32 packets)
+{
+	static struct iphdr hdrs[HARNESS_BENCH_SKBS];
+	static struct sk_buff skbs[HARNESS_BENCH_SKBS];
+	struct testbed_metrics testbed;
+	unsigned seed = 1;
+	u64 start, ns;
+	u32 i;
+
+	testbed_metrics_init(&testbed);
+	for (i = 0; i < HARNESS_BENCH_SKBS; ++i) {
+		random_iphdr(&hdrs[i], &seed);
+		skbs[i].data = (unsigned char *) &hdrs[i];
+		skbs[i].protocol = htons(ETH_P_IP);
+		testbed_set_enqueue_time(&skbs[i]);
+	}
+
+	start = clock_ns(CLOCK_MONOTONIC);
+	for (i = 0; i < packets; ++i) {
+		struct sk_buff *skb = &skbs[i % HARNESS_BENCH_SKBS];
+
+		if ((i & 7) == 0)
+			testbed_inc_drop_count(skb, &testbed);
+		testbed_add_metrics(skb, &testbed);
+	}
+	ns = clock_ns(CLOCK_MONOTONIC) - start;
+
+#ifdef TESTBED_FAST_CLOCK
+	printf("testbed_add_metrics (fast clock): %.1f ns/packet\n", (double) ns / packets);
+#else
+	printf("testbed_add_metrics (real clock): %.1f ns/packet\n", (double) ns / packets);
+#endif
+}
+
+int main(int argc, char **argv)
+{
+	u32 packets = argc > 1 ? strtoul(argv[1], NULL, 10) : HARNESS_PACKETS;
+
+	test_ipv4(packets, 1);
+	test_ipv6(packets, 2);
+	if (failed)
+		return 1;
+	printf("%u IPv4 and IPv6 packets ok\n", packets);
+
+	bench(packets);
+	return 0;
+}
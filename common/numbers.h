@@ -1,10 +1,50 @@
+#if defined(__cplusplus) && __cplusplus >= 201402L
+/* lets the analyzer generate decode tables at compile time */
+#define NUMBERS_CONSTEXPR constexpr
+#else
+/* only what is used is emitted, the BPF program can't have int2fl */
+#define NUMBERS_CONSTEXPR static inline
+#endif
+
+/* Layout of the 16 bit metrics field written by testbed_add_metrics
+ *
+ * The queue delay is stored in the lowest QDELAY_M + QDELAY_E bits and the
+ * number of drops in the bits above. The values can be changed at compile
+ * time, e.g. -DQDELAY_M=8 -DDROPS_E=2 for finer queue delay, as long as the
+ * kernel modules and the analyzer are built with the same values.
+ */
+
 /* we store drops in 5 bits */
+#ifndef DROPS_M
 #define DROPS_M 2
+#endif
+#ifndef DROPS_E
 #define DROPS_E 3
+#endif
 
 /* we store queue length in 11 bits */
+#ifndef QDELAY_M
 #define QDELAY_M 7
+#endif
+#ifndef QDELAY_E
 #define QDELAY_E 4
+#endif
+
+/* queue delay is stored as ns right shifted this much (units of 32 us) */
+#ifndef QDELAY_SHIFT
+#define QDELAY_SHIFT 15
+#endif
+
+#define QDELAY_BITS (QDELAY_M + QDELAY_E)
+#define DROPS_BITS (DROPS_M + DROPS_E)
+
+#if QDELAY_BITS + DROPS_BITS > 16
+#error "metrics must fit in 16 bits"
+#endif
+
+#define METRICS_PACK(qdelay, drops) ((qdelay) | ((drops) << QDELAY_BITS))
+#define METRICS_QDELAY(id) ((id) & ((1 << QDELAY_BITS) - 1))
+#define METRICS_DROPS(id) (((id) >> QDELAY_BITS) & ((1 << DROPS_BITS) - 1))
 
 /* Decode float value
  *
@@ -12,7 +52,7 @@
  * m_b: Number of mantissa bits
  * e_b: Number of exponent bits
  */
-u32 fl2int(u32 fl, u32 m_b, u32 e_b)
+NUMBERS_CONSTEXPR u32 fl2int(u32 fl, u32 m_b, u32 e_b)
 {
 	const u32 m_max = 1 << m_b;
 
@@ -33,9 +73,9 @@ u32 fl2int(u32 fl, u32 m_b, u32 e_b)
  * e_b: Number of exponent bits
  * r: Variable where the remainder will be stored
  */
-u32 int2fl(u32 val, u32 m_b, u32 e_b, u32 *r)
+NUMBERS_CONSTEXPR u32 int2fl(u32 val, u32 m_b, u32 e_b, u32 *r)
 {
-	u32 len, exponent, mantissa;
+	u32 len = 0, exponent = 0, mantissa = 0;
 	const u32 max_e = (1 << e_b) - 1;
 	const u32 max_m = (1 << m_b) - 1;
 	const u32 max_fl = ((max_m << 1) + 1) << (max_e - 1);
@@ -63,6 +103,10 @@ u32 int2fl(u32 val, u32 m_b, u32 e_b, u32 *r)
 }
 
 #ifdef TESTBED_ANALYZER /* don't include in kernel compilation due to SSE */
+
+#define DROPS_CODES (1 << DROPS_BITS)
+#define QDELAY_CODES (1 << QDELAY_BITS)
+
 /* Decode queueing delay
  *
  * The code is left here so that this file is used as an API for
@@ -71,13 +115,117 @@ u32 int2fl(u32 val, u32 m_b, u32 e_b, u32 *r)
  *
  * Return value is in us
  */
-u32 qdelay_decode(u32 value)
+NUMBERS_CONSTEXPR u32 qdelay_decode_layout(u32 value, u32 m_b, u32 e_b, u32 shift)
 {
 	/* Input value is originally time in ns right shifted 15 times
 	 * to get division by 1000 and units of 32 us. The right shifting
 	 * by 10 to do division by 1000 actually causes a rounding
 	 * we correct by doing (x * (1024/1000)) here.
 	 */
-	return fl2int(value, QDELAY_M, QDELAY_E) * 32 * 1.024;
+	return fl2int(value, m_b, e_b) * ((1 << shift) / 1024.0) * 1.024;
 }
+
+NUMBERS_CONSTEXPR u32 qdelay_decode(u32 value)
+{
+	return qdelay_decode_layout(value, QDELAY_M, QDELAY_E, QDELAY_SHIFT);
+}
+
+#if defined(__cplusplus) && __cplusplus >= 201402L
+/* Lookup tables for decoding every possible drops and qdelay value,
+ * generated at compile time.
+ */
+template <u32 N>
+struct numbers_table {
+	u32 v[N];
+};
+
+/* Encoding descriptor for the metrics field
+ *
+ * Everything is derived from the bit widths at compile time, so an
+ * analyzer built for another layout has no extra runtime cost.
+ */
+template <u32 DropsM, u32 DropsE, u32 QdelayM, u32 QdelayE, u32 QdelayShift>
+struct metrics_encoding {
+	static constexpr u32 drops_m = DropsM;
+	static constexpr u32 drops_e = DropsE;
+	static constexpr u32 qdelay_m = QdelayM;
+	static constexpr u32 qdelay_e = QdelayE;
+	static constexpr u32 qdelay_shift = QdelayShift;
+
+	static constexpr u32 qdelay_bits = QdelayM + QdelayE;
+	static constexpr u32 drops_bits = DropsM + DropsE;
+	static constexpr u32 qdelay_codes = 1 << qdelay_bits;
+	static constexpr u32 drops_codes = 1 << drops_bits;
+
+	static_assert(qdelay_bits + drops_bits <= 16, "metrics must fit in 16 bits");
+
+	static constexpr u32 qdelay_code(u32 id) { return id & (qdelay_codes - 1); }
+	static constexpr u32 drops_code(u32 id) { return (id >> qdelay_bits) & (drops_codes - 1); }
+	static constexpr u32 pack(u32 qdelay, u32 drops) { return qdelay | (drops << qdelay_bits); }
+
+	/* kernel side: queue delay in ns and number of drops to a metrics field */
+	static constexpr u32 encode(unsigned long long qdelay_ns, u32 drops)
+	{
+		u32 r = 0;
+		return pack(int2fl(qdelay_ns >> qdelay_shift, qdelay_m, qdelay_e, &r),
+			    int2fl(drops, drops_m, drops_e, &r));
+	}
+
+	static constexpr numbers_table<drops_codes> drops_table_gen()
+	{
+		numbers_table<drops_codes> t = {};
+		for (u32 i = 0; i < drops_codes; ++i)
+			t.v[i] = fl2int(i, drops_m, drops_e);
+		return t;
+	}
+
+	static constexpr numbers_table<qdelay_codes> qdelay_table_gen()
+	{
+		numbers_table<qdelay_codes> t = {};
+		for (u32 i = 0; i < qdelay_codes; ++i)
+			t.v[i] = qdelay_decode_layout(i, qdelay_m, qdelay_e, qdelay_shift);
+		return t;
+	}
+
+	static constexpr numbers_table<drops_codes> drops_table = drops_table_gen();
+	static constexpr numbers_table<qdelay_codes> qdelay_table = qdelay_table_gen();
+
+	/* The tables must give the same as the scalar decoders, and encoding
+	 * a decoded value must give back the same code, for every code.
+	 */
+	static constexpr bool tables_exact()
+	{
+		for (u32 i = 0; i < drops_codes; ++i) {
+			u32 r = 0;
+			u32 val = fl2int(i, drops_m, drops_e);
+			if (drops_table.v[i] != val || int2fl(val, drops_m, drops_e, &r) != i || r != 0)
+				return false;
+		}
+		for (u32 i = 0; i < qdelay_codes; ++i) {
+			u32 r = 0;
+			u32 val = fl2int(i, qdelay_m, qdelay_e);
+			if (qdelay_table.v[i] != qdelay_decode_layout(i, qdelay_m, qdelay_e, qdelay_shift) ||
+			    int2fl(val, qdelay_m, qdelay_e, &r) != i || r != 0)
+				return false;
+		}
+		return true;
+	}
+};
+
+template <u32 DM, u32 DE, u32 QM, u32 QE, u32 QS>
+constexpr numbers_table<metrics_encoding<DM, DE, QM, QE, QS>::drops_codes>
+	metrics_encoding<DM, DE, QM, QE, QS>::drops_table;
+template <u32 DM, u32 DE, u32 QM, u32 QE, u32 QS>
+constexpr numbers_table<metrics_encoding<DM, DE, QM, QE, QS>::qdelay_codes>
+	metrics_encoding<DM, DE, QM, QE, QS>::qdelay_table;
+
+/* the layout the kernel modules are built with */
+typedef metrics_encoding<DROPS_M, DROPS_E, QDELAY_M, QDELAY_E, QDELAY_SHIFT> testbed_encoding;
+
+static_assert(testbed_encoding::tables_exact(), "decode tables differ from fl2int/int2fl");
+
+static constexpr const numbers_table<DROPS_CODES> &drops_decode_table = testbed_encoding::drops_table;
+static constexpr const numbers_table<QDELAY_CODES> &qdelay_decode_table = testbed_encoding::qdelay_table;
+
+#endif /* __cplusplus */
 #endif
@@ -6,7 +6,12 @@
  * should not be included.
  */
 
+#include <linux/if_vlan.h>
+#include <linux/seq_file.h>
+#include <linux/timekeeping.h>
+#include <net/checksum.h>
 #include <net/inet_ecn.h>
+#include <net/ipv6.h>
 #include "numbers.h"
 
 /* This constant defines whether to include drop/queue level report and other
@@ -23,86 +28,175 @@ struct testbed_metrics {
 	 */
 	u16     drops_ecn;
 	u16     drops_nonecn;
+
+	/* Number of times the encoded value was too coarse, i.e. the
+	 * remainder was above the thresholds below. These are counted
+	 * instead of logged so the dequeue path is not slowed down.
+	 */
+	u32     drops_remainder_high;
+	u32     qdelay_remainder_high;
+
+	/* Exact number of drops since init. The drops carried in the packets
+	 * are limited by the encoding and delayed until the next packet in
+	 * the same queue, so these are exported out of band as well (see
+	 * testbed_seq_show) for the analyzer to read at each sample.
+	 */
+	u64     drops_ecn_total;
+	u64     drops_nonecn_total;
 };
 
+#define TESTBED_DROPS_REMAINDER_HIGH 10
+#define TESTBED_QDELAY_REMAINDER_HIGH 20
+
 void testbed_metrics_init(struct testbed_metrics *testbed)
 {
 	testbed->drops_ecn = 0;
 	testbed->drops_nonecn = 0;
+	testbed->drops_remainder_high = 0;
+	testbed->qdelay_remainder_high = 0;
+	testbed->drops_ecn_total = 0;
+	testbed->drops_nonecn_total = 0;
 }
 
-void testbed_inc_drop_count(struct sk_buff *skb, struct testbed_metrics *testbed)
+/* Clock used for the queue delay, the real time clock of the enqueue
+ * timestamp set by __net_timestamp(). Schedulers defining
+ * TESTBED_FAST_CLOCK use the fast monotonic clock instead, which is
+ * lockless and cheaper, and must then set the enqueue timestamp with
+ * testbed_set_enqueue_time() so both come from the same clock.
+ */
+static inline u64 testbed_now_ns(void)
 {
-	struct iphdr* iph;
-	struct ethhdr* ethh;
+#ifdef TESTBED_FAST_CLOCK
+	return ktime_get_mono_fast_ns();
+#else
+	return ktime_get_real_ns();
+#endif
+}
 
-	ethh = eth_hdr(skb);
+static inline void testbed_set_enqueue_time(struct sk_buff *skb)
+{
+#ifdef TESTBED_FAST_CLOCK
+	skb->tstamp = ns_to_ktime(testbed_now_ns());
+#else
+	__net_timestamp(skb);
+#endif
+}
 
-	/* TODO: make IPv6 compatible (but we probably won't going to use it in our testbed?) */
-	if (ntohs(ethh->h_proto) == ETH_P_IP) {
-		iph = ip_hdr(skb);
+/* returns the TOS/traffic class of IPv4 and IPv6 packets, -1 for others */
+int testbed_get_dsfield(struct sk_buff *skb)
+{
+	switch (ntohs(vlan_get_protocol(skb))) {
+	case ETH_P_IP:
+		return ipv4_get_dsfield(ip_hdr(skb));
+	case ETH_P_IPV6:
+		return ipv6_get_dsfield(ipv6_hdr(skb));
+	default:
+		return -1;
+	}
+}
+
+void testbed_inc_drop_count(struct sk_buff *skb, struct testbed_metrics *testbed)
+{
+	int dsfield = testbed_get_dsfield(skb);
 
-		if ((iph->tos & 3))
-			testbed->drops_ecn++;
-		else
-			testbed->drops_nonecn++;
+	if (dsfield < 0)
+		return;
+
+	if ((dsfield & 3)) {
+		testbed->drops_ecn++;
+		testbed->drops_ecn_total++;
+	} else {
+		testbed->drops_nonecn++;
+		testbed->drops_nonecn_total++;
 	}
 }
 
-u32 testbed_get_drops(struct iphdr *iph, struct testbed_metrics *testbed)
+/* Writes the counters as "name value" lines, for a procfs (or debugfs)
+ * file created by the scheduler, e.g. /proc/net/<qdisc>_testbed, which
+ * is given to the analyzer with -c. The counters are read without the
+ * qdisc lock, which is fine for 64 bit counters on 64 bit machines.
+ */
+void testbed_seq_show(struct seq_file *seq, struct testbed_metrics *testbed)
+{
+	seq_printf(seq, "drops_ecn %llu\n", READ_ONCE(testbed->drops_ecn_total));
+	seq_printf(seq, "drops_nonecn %llu\n", READ_ONCE(testbed->drops_nonecn_total));
+	seq_printf(seq, "drops_remainder_high %u\n", READ_ONCE(testbed->drops_remainder_high));
+	seq_printf(seq, "qdelay_remainder_high %u\n", READ_ONCE(testbed->qdelay_remainder_high));
+}
+
+u32 testbed_get_drops_dsfield(u8 dsfield, struct testbed_metrics *testbed)
 {
 	u32 drops;
 	u32 drops_remainder;
 
-	if ((iph->tos & 3)) {
+	if ((dsfield & 3)) {
 		drops = int2fl(testbed->drops_ecn, DROPS_M, DROPS_E, &drops_remainder);
-		if (drops_remainder > 10) {
-			pr_info("High (>10) drops ecn remainder:  %u\n", drops_remainder);
-		}
 		testbed->drops_ecn = (__force __u16) drops_remainder;
 	} else {
 		drops = int2fl(testbed->drops_nonecn, DROPS_M, DROPS_E, &drops_remainder);
-		if (drops_remainder > 10) {
-			pr_info("High (>10) drops nonecn remainder:  %u\n", drops_remainder);
-		}
 		testbed->drops_nonecn = (__force __u16) drops_remainder;
 	}
+	if (unlikely(drops_remainder > TESTBED_DROPS_REMAINDER_HIGH))
+		testbed->drops_remainder_high++;
 	return drops;
 }
 
-/* add metrics used by traffic analyzer to packet before dispatching */
+u32 testbed_get_drops(struct iphdr *iph, struct testbed_metrics *testbed)
+{
+	return testbed_get_drops_dsfield(iph->tos, testbed);
+}
+
+/* queue delay of the packet converted from ns to units of 32 us and encoded as float */
+u32 testbed_get_qdelay(struct sk_buff *skb, struct testbed_metrics *testbed)
+{
+	u32 qdelay;
+	u32 qdelay_remainder;
+
+	qdelay = ((__force __u64)(testbed_now_ns() - ktime_to_ns(skb->tstamp))) >> QDELAY_SHIFT;
+	qdelay = int2fl(qdelay, QDELAY_M, QDELAY_E, &qdelay_remainder);
+	if (unlikely(qdelay_remainder > TESTBED_QDELAY_REMAINDER_HIGH))
+		testbed->qdelay_remainder_high++;
+
+	return qdelay;
+}
+
+/* add metrics used by traffic analyzer to packet before dispatching
+ *
+ * IPv4 packets carry the metrics in the id field. IPv6 packets have no id
+ * field, so the lowest 16 bits of the flow label are used instead.
+ */
 void testbed_add_metrics(struct sk_buff *skb, struct testbed_metrics *testbed)
 {
 	struct iphdr *iph;
-	struct ethhdr *ethh;
-	u32 check;
+	struct ipv6hdr *ip6h;
+	__be16 new_id;
 	u16 drops;
 	u16 id;
-	u32 qdelay;
-	u32 qdelay_remainder;
 
-	ethh = eth_hdr(skb);
-	if (ntohs(ethh->h_proto) == ETH_P_IP) {
+	switch (ntohs(vlan_get_protocol(skb))) {
+	case ETH_P_IP:
 		iph = ip_hdr(skb);
-		id = ntohs(iph->id);
-		check = ntohs((__force __be16)iph->check);
-		check += id;
-		if ((check+1) >> 16) check = (check+1) & 0xffff;
-
-		/* queue delay is converted from ns to units of 32 us and encoded as float */
-		qdelay = ((__force __u64)(ktime_get_real_ns() - ktime_to_ns(skb_get_ktime(skb)))) >> 15;
-		qdelay = int2fl(qdelay, QDELAY_M, QDELAY_E, &qdelay_remainder);
-		if (qdelay_remainder > 20) {
-			pr_info("High (>20) queue delay remainder:  %u\n", qdelay_remainder);
-		}
-
-		id = (__force __u16) qdelay;
+
+		id = (__force __u16) testbed_get_qdelay(skb, testbed);
 		drops = (__force __u16) testbed_get_drops(iph, testbed);
-		id = id | (drops << 11); /* use upper 5 bits in id field to store number of drops before the current packet */
+		id = METRICS_PACK(id, drops); /* use upper bits in id field to store number of drops before the current packet */
+
+		/* incremental checksum update for the changed id (RFC 1624) */
+		new_id = htons(id);
+		csum_replace2(&iph->check, iph->id, new_id);
+		iph->id = new_id;
+		break;
+
+	case ETH_P_IPV6:
+		ip6h = ipv6_hdr(skb);
+
+		id = (__force __u16) testbed_get_qdelay(skb, testbed);
+		drops = (__force __u16) testbed_get_drops_dsfield(ipv6_get_dsfield(ip6h), testbed);
+		id = METRICS_PACK(id, drops);
 
-		check -= id;
-		check += check >> 16; /* adjust carry */
-		iph->id = htons(id);
-		iph->check = (__force __sum16)htons(check);
+		/* there is no header checksum to update */
+		ip6h->flow_lbl[1] = id >> 8;
+		ip6h->flow_lbl[2] = id & 0xff;
+		break;
 	}
 }